@@ -0,0 +1,108 @@
+// Times tb_render() on frames where every cell changes, with the rows split
+// across 1 to 8 threads (tb_set_render_threads). Renders into a pty whose
+// other end is drained by a thread, so the write() is part of the numbers.
+//
+//   bench-bands [width height [frames]]
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <pty.h>
+#include <sys/ioctl.h>
+#include "../src/termbox.h"
+
+static volatile long drained = 0;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+static void *drain(void *arg) {
+  int fd = *(int *)arg;
+  char buf[64 * 1024];
+  ssize_t n;
+
+  while ((n = read(fd, buf, sizeof(buf))) > 0)
+    drained += n;
+  return NULL;
+}
+
+// fills the back buffer so that every cell differs from the frame before
+static void fill(int w, int h, int frame) {
+  int x, y;
+  for (y = 0; y < h; ++y) {
+    for (x = 0; x < w; ++x) {
+      int v = x * 7 + y * 13 + frame;
+      tb_char(x, y, 16 + v % 216, 232 + (v / 3) % 24, 'a' + (v + frame) % 26);
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  int w = argc > 2 ? atoi(argv[1]) : 400;
+  int h = argc > 2 ? atoi(argv[2]) : 120;
+  int frames = argc > 3 ? atoi(argv[3]) : 200;
+  struct winsize ws = { h, w, 0, 0 };
+  int master, slave, threads, f;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  char name[256];
+  pthread_t reader;
+  double start, elapsed, base = 0;
+  long bytes;
+
+  if (openpty(&master, &slave, name, NULL, &ws) != 0) {
+    perror("openpty");
+    return 1;
+  }
+
+  pthread_create(&reader, NULL, drain, &master);
+  setenv("TERM", "xterm-256color", 0);
+
+  if (tb_init_file(name) != 0 || tb_init_screen(TB_INIT_ALTSCREEN) != 0) {
+    fprintf(stderr, "tb_init failed\n");
+    return 1;
+  }
+  tb_select_output_mode(TB_OUTPUT_256);
+
+  w = tb_width();
+  h = tb_height();
+
+  static char report[1024];
+  int len = 0;
+  len += snprintf(report + len, sizeof(report) - len, "%dx%d, %d frames, %ld cpus\n", w, h, frames, cpus);
+  len += snprintf(report + len, sizeof(report) - len, "%-8s %12s %12s %9s\n", "threads", "us/frame", "bytes/frame", "speedup");
+
+  for (threads = 1; threads <= 8; ++threads) {
+    if (tb_set_render_threads(threads) != 0) {
+      fprintf(stderr, "could not start %d threads\n", threads);
+      break;
+    }
+
+    bytes = drained;
+    start = now();
+    for (f = 0; f < frames; ++f) {
+      fill(w, h, f);
+      tb_render();
+    }
+    elapsed = (now() - start) * 1e6 / frames;
+    if (threads == 1)
+      base = elapsed;
+
+    len += snprintf(report + len, sizeof(report) - len, "%-8d %12.0f %12ld %8.2fx\n",
+      threads, elapsed, (drained - bytes) / frames, base / elapsed);
+  }
+
+  tb_shutdown();
+  if (cpus < 8)
+    snprintf(report + len, sizeof(report) - len,
+      "only %ld cpus: more threads than that can't run at once, so no speedup is measured past %ld\n",
+      cpus, cpus);
+  fputs(report, stdout);
+  return 0;
+}
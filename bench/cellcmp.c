@@ -0,0 +1,116 @@
+// Compares the row diff kernels in src/cellcmp.inl against the old per-cell
+// wcwidth() + memcmp() loop, over an unchanged frame with a few edits.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <wchar.h>
+#include <locale.h>
+#include "../src/termbox.h"
+
+// the kernels work on whatever the buffers store; here that's plain cells
+typedef struct tb_cell cell_t;
+
+#include "../src/cellcmp.inl"
+
+static const int sizes[][2] = {
+  { 80, 24 }, { 200, 50 }, { 300, 90 }, { 500, 200 }
+};
+
+#define CHANGES 8
+#define MIN_TIME 0.2 // seconds per measurement
+
+static volatile int sink;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+// what tb_render() used to do for every cell
+static int diff_loop(struct tb_cell *back, struct tb_cell *front, int w, int h) {
+  int x, y, cw, changed = 0;
+  for (y = 0; y < h; ++y) {
+    for (x = 0; x < w; ) {
+      struct tb_cell *b = &back[y * w + x], *f = &front[y * w + x];
+      cw = wcwidth(b->ch);
+      if (cw < 1) cw = 1;
+      if (memcmp(b, f, sizeof(struct tb_cell)) != 0)
+        changed++;
+      x += cw;
+    }
+  }
+  return changed;
+}
+
+static int diff_kernel(cellcmp_func fn, struct tb_cell *back, struct tb_cell *front, int w, int h) {
+  int x, y, changed = 0;
+  for (y = 0; y < h; ++y) {
+    for (x = 0; x < w; ++x) {
+      x += fn(&back[y * w + x], &front[y * w + x], w - x);
+      if (x < w) changed++;
+    }
+  }
+  return changed;
+}
+
+static double measure(cellcmp_func fn, struct tb_cell *back, struct tb_cell *front, int w, int h) {
+  long rounds = 0;
+  double start = now(), elapsed;
+  do {
+    sink = fn ? diff_kernel(fn, back, front, w, h) : diff_loop(back, front, w, h);
+    rounds++;
+  } while ((elapsed = now() - start) < MIN_TIME);
+  return elapsed * 1e9 / rounds;
+}
+
+int main(void) {
+  unsigned i, c;
+  setlocale(LC_ALL, "");
+
+  // resolve the dispatched kernel before timing it
+  struct tb_cell dummy = { ' ', 0, 0 };
+  cellcmp(&dummy, &dummy, 1);
+
+  printf("cell size: %d bytes\n", (int)sizeof(struct tb_cell));
+  printf("%-9s %12s %12s %12s %12s %12s\n", "size", "loop ns", "scalar ns", "sse2 ns", "avx2 ns", "dispatch ns");
+
+  for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+    int w = sizes[i][0], h = sizes[i][1], n = w * h;
+    struct tb_cell *back = malloc(sizeof(struct tb_cell) * n);
+    struct tb_cell *front = malloc(sizeof(struct tb_cell) * n);
+    char label[16];
+
+    for (c = 0; c < (unsigned)n; ++c) {
+      back[c].ch = 'a' + c % 26;
+      back[c].fg = TB_WHITE;
+      back[c].bg = TB_DEFAULT;
+    }
+    memcpy(front, back, sizeof(struct tb_cell) * n);
+    for (c = 0; c < CHANGES; ++c)
+      back[(c * 7919) % n].ch = '#';
+
+    snprintf(label, sizeof(label), "%dx%d", w, h);
+    printf("%-9s %12.0f %12.0f", label,
+      measure(NULL, back, front, w, h),
+      measure(cellcmp_scalar, back, front, w, h));
+#ifdef CELLCMP_X86
+    printf(" %12.0f", measure(cellcmp_sse2, back, front, w, h));
+    if (__builtin_cpu_supports("avx2"))
+      printf(" %12.0f", measure(cellcmp_avx2, back, front, w, h));
+    else
+      printf(" %12s", "-");
+#else
+    printf(" %12s %12s", "-", "-");
+#endif
+    printf(" %12.0f\n", measure(cellcmp, back, front, w, h));
+
+    free(back);
+    free(front);
+  }
+
+  return 0;
+}
@@ -0,0 +1,90 @@
+// Compares the fill kernels in src/cellfill.inl against the old field-by-field
+// clear loop and a plain memset() of the same number of bytes.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../src/termbox.h"
+
+// the kernels work on whatever the buffers store; here that's plain cells
+typedef struct tb_cell cell_t;
+
+#include "../src/cellcmp.inl"
+#include "../src/cellfill.inl"
+
+static const int sizes[][2] = {
+  { 80, 24 }, { 400, 120 }, { 4096, 1 }, { 4096, 256 }
+};
+
+#define MIN_TIME 0.2 // seconds per measurement
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+// what cellbuf_clear() used to do
+static void clear_loop(struct tb_cell *cells, const struct tb_cell *cell, int n) {
+  int i;
+  for (i = 0; i < n; ++i) {
+    cells[i].ch = cell->ch;
+    cells[i].fg = cell->fg;
+    cells[i].bg = cell->bg;
+  }
+}
+
+static void clear_memset(struct tb_cell *cells, const struct tb_cell *cell, int n) {
+  memset(cells, cell->ch, sizeof(struct tb_cell) * n);
+}
+
+typedef void (*fill_func)(struct tb_cell *cells, const struct tb_cell *cell, int n);
+
+static double measure(fill_func fn, struct tb_cell *cells, int n) {
+  struct tb_cell blank = { ' ', TB_WHITE, TB_DEFAULT };
+  long rounds = 0;
+  double start = now(), elapsed;
+  do {
+    fn(cells, &blank, n);
+    __asm__ volatile("" : : "r"(cells) : "memory");
+    rounds++;
+  } while ((elapsed = now() - start) < MIN_TIME);
+  return elapsed * 1e9 / rounds;
+}
+
+int main(void) {
+  unsigned i;
+
+  // resolve the dispatched kernel before timing it
+  struct tb_cell dummy = { ' ', 0, 0 };
+  cellfill(&dummy, &dummy, 1);
+
+  printf("cell size: %d bytes\n", (int)sizeof(struct tb_cell));
+  printf("%-9s %12s %12s %12s %12s %12s\n", "size", "loop ns", "scalar ns", "sse2 ns", "avx ns", "memset ns");
+
+  for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+    int w = sizes[i][0], h = sizes[i][1], n = w * h;
+    struct tb_cell *cells = aligned_alloc(64, (sizeof(struct tb_cell) * n + 63) & ~63);
+    char label[16];
+
+    snprintf(label, sizeof(label), "%dx%d", w, h);
+    printf("%-9s %12.0f %12.0f", label,
+      measure(clear_loop, cells, n), measure(cellfill_scalar, cells, n));
+#ifdef CELLCMP_X86
+    printf(" %12.0f", measure(cellfill_sse2, cells, n));
+    if (__builtin_cpu_supports("avx"))
+      printf(" %12.0f", measure(cellfill_avx, cells, n));
+    else
+      printf(" %12s", "-");
+#else
+    printf(" %12s %12s", "-", "-");
+#endif
+    printf(" %12.0f\n", measure(clear_memset, cells, n));
+
+    free(cells);
+  }
+
+  return 0;
+}
@@ -0,0 +1,233 @@
+// Drives tb_render() through a set of typical workloads, in each output mode
+// and at a few terminal sizes, and prints the results as JSON. Runs headless
+// (tb_init_headless), so it needs no tty: the output is counted by the sink.
+//
+//   bench-render [frames [workload]]
+//
+// Per frame, it reports the time spent in tb_render() and the bytes it
+// produced. It also counts the write() calls a tty would have taken and the
+// malloc/calloc/realloc calls made, the last only with glibc.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include "../src/termbox.h"
+
+#define WARMUP_FRAMES 5
+
+// the largest write() termbox makes at a time, see FLUSH_CHUNK
+#define WRITE_CHUNK (64 * 1024)
+
+static long allocs = 0;
+
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size) {
+  allocs++;
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+  allocs++;
+  return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  allocs++;
+  return __libc_realloc(ptr, size);
+}
+#define COUNTS_ALLOCS 1
+#else
+#define COUNTS_ALLOCS 0
+#endif
+
+static long bytes = 0;
+static long writes = 0;
+
+static void sink(const char *data, int len, void *user_data) {
+  (void)data;
+  (void)user_data;
+  bytes += len;
+  writes += (len + WRITE_CHUNK - 1) / WRITE_CHUNK;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+static const int sizes[][2] = {
+  { 80, 24 }, { 200, 60 }, { 500, 200 }
+};
+
+static const struct {
+  const char *name;
+  int mode;
+} modes[] = {
+  { "normal", TB_OUTPUT_NORMAL },
+  { "256", TB_OUTPUT_256 },
+#ifdef WITH_TRUECOLOR
+  { "truecolor", TB_OUTPUT_TRUECOLOR },
+#endif
+};
+
+static int mode;
+
+// the nearest color to r/g/b the current output mode has
+static tb_color color(int r, int g, int b) {
+#ifdef WITH_TRUECOLOR
+  if (mode == TB_OUTPUT_TRUECOLOR || mode == TB_OUTPUT_NORMAL)
+    return (r << 16) | (g << 8) | b;
+#endif
+  if (mode == TB_OUTPUT_256)
+    return 16 + 36 * (r / 43) + 6 * (g / 43) + b / 43;
+  return 1 + ((r >> 7) | (g >> 7) << 1 | (b >> 7) << 2);
+}
+
+// a clock ticking in the middle of an otherwise still screen
+static void clock_frame(int w, int h, int f) {
+  int t = 36000 + f;
+  tb_stringf(w / 2 - 4, h / 2, color(255, 255, 255), color(0, 0, 128), "%02d:%02d:%02d",
+    t / 3600 % 24, t / 60 % 60, t % 60);
+}
+
+// a log scrolling up by a line each frame
+static void log_frame(int w, int h, int f) {
+  static const char *paths[] = { "/", "/api/v1/items", "/login", "/static/app.js", "/api/v1/users/me" };
+  static const int status[] = { 200, 200, 200, 304, 404, 500 };
+  int y, n, s;
+
+  (void)w;
+  tb_clear_buffer();
+  for (y = 0; y < h; ++y) {
+    n = f + y;
+    s = status[n % 6];
+    tb_stringf(0, y, s >= 500 ? color(255, 0, 0) : s >= 400 ? color(255, 255, 0) : color(192, 192, 192),
+      TB_DEFAULT, "%06d GET %s %d %dms", n, paths[n % 5], s, n * 7 % 300);
+  }
+}
+
+// the whole screen in a gradient that shifts each frame
+static void gradient_frame(int w, int h, int f) {
+  int x, y;
+
+  for (y = 0; y < h; ++y) {
+    for (x = 0; x < w; ++x)
+      tb_char(x, y, TB_DEFAULT, color((x * 255 / w + f) & 255, y * 255 / h, (f * 4) & 255), ' ');
+  }
+}
+
+// wide chars and clusters: CJK, emoji, flags, ZWJ sequences
+static void cjk_frame(int w, int h, int f) {
+  static const char *lines[] = {
+    "终端里的中文文本，每个字占两列。",
+    "日本語のテキストと😀絵文字が混ざった行 🎉🎉",
+    "한국어 텍스트도 넓은 글자입니다",
+    "flags 🇯🇵 🇰🇷 🇨🇳 and families 👨‍👩‍👧 mixed with ascii",
+  };
+  int y;
+
+  (void)w;
+  tb_clear_buffer();
+  for (y = 0; y < h; ++y)
+    tb_string((y + f) % 7, y, color(255, 255, 255), TB_DEFAULT, lines[(y + f) % 4]);
+}
+
+// a moving plasma drawn with half blocks, two pixels to a cell
+static void image_frame(int w, int h, int f) {
+  double t = f * 0.1, v;
+  int x, y, i, rgb[2][3];
+
+  for (y = 0; y < h; ++y) {
+    for (x = 0; x < w; ++x) {
+      for (i = 0; i < 2; ++i) {
+        v = sin(x * 0.07 + t) + sin((y * 2 + i) * 0.11 - t) + sin((x + y) * 0.05 + t * 0.7);
+        rgb[i][0] = (int)(127.5 + 127.5 * sin(v));
+        rgb[i][1] = (int)(127.5 + 127.5 * sin(v + 2.09));
+        rgb[i][2] = (int)(127.5 + 127.5 * sin(v + 4.19));
+      }
+      tb_char(x, y, color(rgb[0][0], rgb[0][1], rgb[0][2]), color(rgb[1][0], rgb[1][1], rgb[1][2]), 0x2580);
+    }
+  }
+}
+
+static const struct {
+  const char *name;
+  void (*frame)(int w, int h, int f);
+} workloads[] = {
+  { "clock", clock_frame },
+  { "log", log_frame },
+  { "gradient", gradient_frame },
+  { "cjk", cjk_frame },
+  { "image", image_frame },
+};
+
+#define LEN(a) (sizeof(a) / sizeof((a)[0]))
+
+int main(int argc, char **argv) {
+  int frames = argc > 1 ? atoi(argv[1]) : 100;
+  const char *only = argc > 2 ? argv[2] : NULL;
+  unsigned wl, m, s;
+  int w, h, f, first = 1;
+  double start, elapsed;
+  long allocs0, rendered;
+
+  printf("[");
+  for (wl = 0; wl < LEN(workloads); ++wl) {
+    if (only && strcmp(only, workloads[wl].name) != 0)
+      continue;
+
+    for (m = 0; m < LEN(modes); ++m) {
+      for (s = 0; s < LEN(sizes); ++s) {
+        w = sizes[s][0];
+        h = sizes[s][1];
+        if (tb_init_headless(w, h, 0, sink, NULL) != 0) {
+          fprintf(stderr, "tb_init_headless failed\n");
+          return 1;
+        }
+
+        mode = modes[m].mode;
+        tb_select_output_mode(mode);
+
+        for (f = 0; f < WARMUP_FRAMES; ++f) {
+          workloads[wl].frame(w, h, f);
+          tb_render();
+        }
+
+        bytes = writes = rendered = 0;
+        elapsed = 0;
+        for (; f < WARMUP_FRAMES + frames; ++f) {
+          workloads[wl].frame(w, h, f);
+          allocs0 = allocs;
+          start = now();
+          tb_render();
+          elapsed += now() - start;
+          rendered += allocs - allocs0;
+        }
+
+        printf("%s\n  {\"workload\": \"%s\", \"mode\": \"%s\", \"width\": %d, \"height\": %d, "
+          "\"frames\": %d, \"ns_per_frame\": %.0f, \"bytes_per_frame\": %.1f, "
+          "\"writes_per_frame\": %.2f, \"allocs_per_frame\": ",
+          first ? "" : ",", workloads[wl].name, modes[m].name, w, h, frames,
+          elapsed * 1e9 / frames, (double)bytes / frames, (double)writes / frames);
+        if (COUNTS_ALLOCS)
+          printf("%.2f}", (double)rendered / frames);
+        else
+          printf("null}");
+        first = 0;
+
+        tb_shutdown();
+      }
+    }
+  }
+  printf("\n]\n");
+
+  return 0;
+}
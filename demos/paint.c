@@ -97,7 +97,7 @@ void updateAndRedrawAll(int mx, int my, int rune) {
     backbuf[bbw*my+mx].fg = colors[curCol];
   }
 
-  memcpy(tb_cell_buffer(), backbuf, sizeof(struct tb_cell)*bbw*bbh);
+  tb_blit(0, 0, bbw, bbh, backbuf, bbw);
   updateAndDrawButtons(&curRune, 0, 0, mx, my, len(runes), runeAttrFunc);
   updateAndDrawButtons(&curCol, 0, h-3, mx, my, len(colors), colorAttrFunc);
 
@@ -0,0 +1,192 @@
+// Parallel rendering. When a frame has enough changed cells, its rows are
+// split into bands, one per thread, and each band is diffed and encoded into
+// a buffer of its own. The calling thread takes the first band, writing
+// straight to 'out' and carrying on from the terminal state it already knows.
+// The other bands start from an unknown cursor position and colors, so their
+// first cell gets an absolute move and a fresh SGR. That makes the bands
+// independent of each other, and they are simply appended in order.
+
+#define MAX_RENDER_THREADS 16
+#define BAND_MIN_CELLS (16 * 1024) // changed cells below which it doesn't pay
+
+struct band {
+  int y0;
+  int y1; // exclusive
+  struct bytebuffer buf;
+  struct renderstate state;
+};
+
+static const struct renderstate band_state_init = {
+  LAST_COORD_INIT, LAST_COORD_INIT, LAST_ATTR_INIT, LAST_ATTR_INIT,
+  SGR_UNKNOWN, SGR_DEFAULT, SGR_DEFAULT, 0, { 0 }
+};
+
+static struct band bands[MAX_RENDER_THREADS];
+static pthread_t band_threads[MAX_RENDER_THREADS];
+static int band_count = 1; // threads rendering, the caller included
+
+// the frame being rendered, set before the workers are woken up
+static struct cellbuf *band_src;
+static bool band_all;
+
+static pthread_mutex_t band_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t band_wakeup = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t band_done = PTHREAD_COND_INITIALIZER;
+static unsigned band_round = 0;
+static int band_pending = 0;
+static bool band_stop = false;
+
+static void render_rows(struct cellbuf *src, int y0, int y1, bool all);
+
+static void *band_main(void *arg) {
+  struct band *band = arg;
+  unsigned round = 0;
+  uint64_t start;
+
+  out = &band->buf;
+  rstate = &band->state;
+
+  pthread_mutex_lock(&band_lock);
+  while (1) {
+    while (round == band_round && !band_stop)
+      pthread_cond_wait(&band_wakeup, &band_lock);
+    if (band_stop)
+      break;
+
+    round = band_round;
+    pthread_mutex_unlock(&band_lock);
+
+    start = trace_begin();
+    render_rows(band_src, band->y0, band->y1, band_all);
+    trace_end("render_band", start);
+
+    pthread_mutex_lock(&band_lock);
+    if (--band_pending == 0)
+      pthread_cond_signal(&band_done);
+  }
+  pthread_mutex_unlock(&band_lock);
+
+  return NULL;
+}
+
+// changed cells in row y, which is all of it for a full redraw
+static int band_row_cells(struct cellbuf *src, int y, bool all) {
+  struct cellspan *span = &src->dirty[y];
+
+  if (all)
+    return src->width;
+  if (span->min > span->max)
+    return 0;
+  return span->max - span->min + 1;
+}
+
+/* Renders the rows of src on all threads, if there's enough to do. Returns
+ * false, having done nothing, when the caller should render on its own. */
+static bool render_bands(struct cellbuf *src, bool all) {
+  int i, y, cells = 0, share, acc, saved;
+  struct band *band;
+  STAT(struct renderstats counts);
+
+  if (band_count < 2)
+    return false;
+
+  for (y = 0; y < src->height; ++y)
+    cells += band_row_cells(src, y, all);
+  if (cells < BAND_MIN_CELLS)
+    return false;
+
+  // give each band about the same number of changed cells
+  share = cells / band_count;
+  for (i = 0, y = 0; i < band_count; ++i) {
+    band = &bands[i];
+    band->y0 = y;
+    for (acc = 0; y < src->height && (acc < share || i == band_count - 1); ++y)
+      acc += band_row_cells(src, y, all);
+    band->y1 = y;
+
+    bytebuffer_clear(&band->buf);
+    band->state = band_state_init;
+  }
+
+  band_src = src;
+  band_all = all;
+
+  pthread_mutex_lock(&band_lock);
+  band_pending = band_count - 1;
+  band_round++;
+  pthread_cond_broadcast(&band_wakeup);
+  pthread_mutex_unlock(&band_lock);
+
+  render_rows(src, bands[0].y0, bands[0].y1, all);
+
+  pthread_mutex_lock(&band_lock);
+  while (band_pending > 0)
+    pthread_cond_wait(&band_done, &band_lock);
+  pthread_mutex_unlock(&band_lock);
+
+  // the terminal ends up as the last band that sent anything left it
+  saved = rstate->cursor_bytes_saved;
+  STAT(counts = rstate->counts);
+  for (i = 1; i < band_count; ++i) {
+    band = &bands[i];
+    saved += band->state.cursor_bytes_saved;
+    STAT(renderstats_add(&counts, &band->state.counts));
+    if (band->buf.len == 0)
+      continue;
+
+    bytebuffer_append(out, band->buf.buf, band->buf.len);
+    acc = band->buf.len;
+    bytebuffer_clear(&band->buf);
+    bytebuffer_trim(&band->buf, acc, OUTPUT_BASELINE);
+    *rstate = band->state;
+    stream_output();
+  }
+  rstate->cursor_bytes_saved = saved;
+  STAT(rstate->counts = counts);
+
+  return true;
+}
+
+static void bands_shutdown(void) {
+  int i;
+
+  if (band_count < 2)
+    return;
+
+  pthread_mutex_lock(&band_lock);
+  band_stop = true;
+  pthread_cond_broadcast(&band_wakeup);
+  pthread_mutex_unlock(&band_lock);
+
+  for (i = 1; i < band_count; ++i) {
+    pthread_join(band_threads[i], NULL);
+    bytebuffer_free(&bands[i].buf);
+  }
+
+  band_count = 1;
+  band_stop = false;
+}
+
+static int bands_start(int n) {
+  cell_t dummy = { 0 };
+
+  bands_shutdown();
+
+  if (n > MAX_RENDER_THREADS)
+    n = MAX_RENDER_THREADS;
+
+  // pick the diff kernel now, before several threads race to do it
+  cellcmp(&dummy, &dummy, 1);
+  band_round = 0;
+
+  for (band_count = 1; band_count < n; ++band_count) {
+    bytebuffer_init(&bands[band_count].buf, 0);
+    if (pthread_create(&band_threads[band_count], NULL, band_main, &bands[band_count]) != 0) {
+      bytebuffer_free(&bands[band_count].buf);
+      bands_shutdown();
+      return -1;
+    }
+  }
+
+  return 0;
+}
@@ -2,6 +2,7 @@ struct bytebuffer {
   char *buf;
   int len;
   int cap;
+  int calm; // flushes in a row that needed no more than the trim size
 };
 
 static void bytebuffer_reserve(struct bytebuffer *b, int cap) {
@@ -23,6 +24,7 @@ static void bytebuffer_init(struct bytebuffer *b, int cap) {
   b->cap = 0;
   b->len = 0;
   b->buf = 0;
+  b->calm = 0;
 
   if (cap > 0) {
     b->cap = cap;
@@ -56,13 +58,13 @@ static void bytebuffer_resize(struct bytebuffer *b, int len) {
 }
 */
 
-static void bytebuffer_flush(struct bytebuffer *b, int fd) {
-  int unused __attribute__((unused));
-  unused = write(fd, b->buf, b->len);
-  bytebuffer_clear(b);
-}
+// largest single write() when flushing, so a big frame goes out in a
+// bounded number of pieces instead of whatever the tty decides to split
+#define FLUSH_CHUNK (64 * 1024)
 
-/*
+static unsigned bytebuffer_writes = 0; // writev() calls made so far
+
+// drops the first n bytes
 static void bytebuffer_truncate(struct bytebuffer *b, int n) {
   if (n <= 0)
     return;
@@ -72,4 +74,92 @@ static void bytebuffer_truncate(struct bytebuffer *b, int n) {
   memmove(b->buf, b->buf+n, nmove);
   b->len -= n;
 }
-*/
\ No newline at end of file
+
+/* Writes out as much of the buffer, followed by 'len' bytes of 'data', as
+ * the fd takes. Both go in the same writev(), so data never gets copied if it
+ * all goes out. If the fd is O_NONBLOCK and fills up, either waits for it
+ * with poll() or, without 'wait', stops there and keeps the rest (data
+ * included) for the next call. Returns the number of bytes left, or -1 if
+ * writing failed (the buffer is dropped then, there's nowhere for it to go). */
+static int bytebuffer_flush_with(struct bytebuffer *b, int fd, bool wait, const char *data, int len) {
+  int off = 0, doff = 0, room, cnt, n;
+  struct iovec iov[2];
+  struct pollfd pfd;
+
+  while (off < b->len || doff < len) {
+    cnt = 0;
+    room = FLUSH_CHUNK;
+
+    if (off < b->len) {
+      iov[cnt].iov_base = b->buf + off;
+      iov[cnt].iov_len = b->len - off < room ? b->len - off : room;
+      room -= iov[cnt++].iov_len;
+    }
+
+    if (doff < len && room > 0) {
+      iov[cnt].iov_base = (char *)data + doff;
+      iov[cnt].iov_len = len - doff < room ? len - doff : room;
+      cnt++;
+    }
+
+    n = writev(fd, iov, cnt);
+    bytebuffer_writes++;
+    if (n > 0) {
+      // whatever's left of the buffer went first
+      room = b->len - off < n ? b->len - off : n;
+      off += room;
+      doff += n - room;
+      continue;
+    }
+
+    if (n < 0 && errno == EINTR)
+      continue;
+
+    if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+      bytebuffer_clear(b);
+      return -1;
+    }
+
+    if (!wait)
+      break;
+
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+    poll(&pfd, 1, -1);
+  }
+
+  bytebuffer_truncate(b, off);
+  if (doff < len)
+    bytebuffer_append(b, data + doff, len - doff);
+  return b->len;
+}
+
+#define TRIM_ROUNDS 64
+
+/* Gives memory back after a spike: once the buffer has gone TRIM_ROUNDS
+ * flushes in a row holding no more than 'cap' bytes, its capacity is cut back
+ * down to that. 'used' is how much it held before this flush. */
+static void bytebuffer_trim(struct bytebuffer *b, int used, int cap) {
+  if (b->cap <= cap || b->len > cap)
+    return;
+
+  if (used > cap) {
+    b->calm = 0;
+    return;
+  }
+
+  if (++b->calm < TRIM_ROUNDS)
+    return;
+
+  b->buf = realloc(b->buf, cap);
+  b->cap = cap;
+  b->calm = 0;
+}
+
+// exchanges the contents of two buffers, instead of copying one into the other
+static void bytebuffer_swap(struct bytebuffer *a, struct bytebuffer *b) {
+  struct bytebuffer tmp = *a;
+  *a = *b;
+  *b = tmp;
+}
+
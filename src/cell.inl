@@ -0,0 +1,173 @@
+// How cells are kept in the internal buffers. Normally that's struct tb_cell
+// itself. True-color cells take 12 bytes though, so building with
+// WITH_COMPACT_CELLS stores them in 8: the char, and the number of its fg/bg
+// pair in a table of styles. Code reading colors off a buffer goes through
+// CELL_FG() and CELL_BG(), and cell_pack() and cell_unpack() convert from
+// and to struct tb_cell.
+
+#if defined(WITH_TRUECOLOR) && defined(WITH_COMPACT_CELLS)
+#define COMPACT_CELLS
+#endif
+
+#ifdef COMPACT_CELLS
+
+struct cell {
+  tb_chr ch;
+  uint32_t style;
+};
+
+typedef struct cell cell_t;
+
+struct style {
+  tb_color fg;
+  tb_color bg;
+};
+
+/* Styles live in fixed-size chunks that never move, so the writer and band
+ * threads can look them up while the main thread adds more. Each is written
+ * once, before any cell refers to it. When the table fills up, the styles
+ * still in use are renumbered (see styles_collect). Style 0 is never handed
+ * out: its colors match nothing, so a cell left with it is always redrawn. */
+#define STYLE_CHUNK_BITS 12
+#define STYLE_CHUNK (1 << STYLE_CHUNK_BITS)
+#define MAX_STYLE_CHUNKS 1024
+#define STYLE_LIMIT_INIT 65536
+#define STYLE_NONE 0
+
+#define STYLE(id) (&style_chunks[(id) >> STYLE_CHUNK_BITS][(id) & (STYLE_CHUNK - 1)])
+#define CELL_FG(c) (STYLE((c)->style)->fg)
+#define CELL_BG(c) (STYLE((c)->style)->bg)
+
+static struct style *style_chunks[MAX_STYLE_CHUNKS];
+static uint32_t style_count = 0;
+static uint32_t style_limit = STYLE_LIMIT_INIT; // collect when it gets here
+static uint32_t style_last = STYLE_NONE; // the last one looked up
+
+// open addressing, from fg/bg to style. 0 marks a free slot
+static uint32_t *style_index = NULL;
+static uint32_t style_index_size = 0;
+
+static void styles_collect(void);
+
+static uint32_t style_hash(tb_color fg, tb_color bg) {
+  uint32_t h = fg * 0x9E3779B1u;
+  h = (h ^ bg) * 0x9E3779B1u;
+  return h ^ (h >> 15);
+}
+
+static void style_index_add(uint32_t id) {
+  uint32_t mask = style_index_size - 1;
+  uint32_t i = style_hash(STYLE(id)->fg, STYLE(id)->bg) & mask;
+
+  while (style_index[i])
+    i = (i + 1) & mask;
+  style_index[i] = id;
+}
+
+static void style_index_rebuild(uint32_t size) {
+  uint32_t id;
+
+  free(style_index);
+  style_index = (uint32_t*)calloc(size, sizeof(uint32_t));
+  assert(style_index);
+  style_index_size = size;
+
+  for (id = 1; id < style_count; ++id)
+    style_index_add(id);
+}
+
+static uint32_t style_add(tb_color fg, tb_color bg) {
+  uint32_t id = style_count;
+
+  assert(id < MAX_STYLE_CHUNKS * STYLE_CHUNK);
+  if (!style_chunks[id >> STYLE_CHUNK_BITS]) {
+    style_chunks[id >> STYLE_CHUNK_BITS] = (struct style*)malloc(sizeof(struct style) * STYLE_CHUNK);
+    assert(style_chunks[id >> STYLE_CHUNK_BITS]);
+  }
+
+  STYLE(id)->fg = fg;
+  STYLE(id)->bg = bg;
+  style_count++;
+
+  if (id == STYLE_NONE)
+    return id;
+
+  // keep the index at most half full
+  if (style_count * 2 > style_index_size)
+    style_index_rebuild(style_index_size ? style_index_size * 2 : 1024);
+  else
+    style_index_add(id);
+
+  return id;
+}
+
+// (re)starts the table with just STYLE_NONE
+static void styles_reset(void) {
+  style_count = 0;
+  style_last = STYLE_NONE;
+  style_add(LAST_ATTR_INIT, LAST_ATTR_INIT);
+  style_index_rebuild(style_index_size ? style_index_size : 1024);
+}
+
+static void styles_free(void) {
+  int i;
+
+  for (i = 0; i < MAX_STYLE_CHUNKS; ++i) {
+    free(style_chunks[i]);
+    style_chunks[i] = NULL;
+  }
+
+  free(style_index);
+  style_index = NULL;
+  style_index_size = 0;
+  style_count = 0;
+  style_limit = STYLE_LIMIT_INIT;
+}
+
+static uint32_t style_intern(tb_color fg, tb_color bg) {
+  uint32_t mask, i, id;
+
+  if (style_count == 0)
+    styles_reset();
+
+  // runs of cells in the same colors are the usual case
+  if (style_last != STYLE_NONE && STYLE(style_last)->fg == fg && STYLE(style_last)->bg == bg)
+    return style_last;
+
+  mask = style_index_size - 1;
+  for (i = style_hash(fg, bg) & mask; (id = style_index[i]); i = (i + 1) & mask) {
+    if (STYLE(id)->fg == fg && STYLE(id)->bg == bg)
+      return style_last = id;
+  }
+
+  if (style_count == style_limit) {
+    styles_collect();
+    return style_intern(fg, bg);
+  }
+
+  return style_last = style_add(fg, bg);
+}
+
+static void cell_pack(cell_t *dst, const struct tb_cell *src) {
+  dst->ch = src->ch;
+  dst->style = style_intern(src->fg, src->bg);
+}
+
+static void cell_unpack(struct tb_cell *dst, const cell_t *src) {
+  dst->ch = src->ch;
+  dst->fg = CELL_FG(src);
+  dst->bg = CELL_BG(src);
+}
+
+#else
+
+typedef struct tb_cell cell_t;
+
+#define CELL_FG(c) ((c)->fg)
+#define CELL_BG(c) ((c)->bg)
+
+static void cell_pack(cell_t *dst, const struct tb_cell *src) {
+  *dst = *src;
+}
+
+#endif
@@ -0,0 +1,96 @@
+// Row comparators used by tb_render() to skip over unchanged cells. Cells are
+// compared as raw bytes (cell_t has no padding, in either the 8 or the
+// 12 byte layout) and the first differing byte is turned back into a cell index.
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CELLCMP_X86
+#endif
+
+typedef int (*cellcmp_func)(const cell_t *a, const cell_t *b, int n);
+
+// returns the index of the first cell in a[0..n) that differs from b, or n
+static int cellcmp_scalar(const cell_t *a, const cell_t *b, int n) {
+  int i;
+  for (i = 0; i < n; ++i) {
+    if (memcmp(&a[i], &b[i], sizeof(cell_t)) != 0)
+      break;
+  }
+  return i;
+}
+
+#ifdef CELLCMP_X86
+
+__attribute__((target("sse2")))
+static int cellcmp_sse2(const cell_t *a, const cell_t *b, int n) {
+  const char *pa = (const char *)a, *pb = (const char *)b;
+  size_t len = (size_t)n * sizeof(cell_t);
+  size_t off = 0;
+  unsigned mask;
+
+  for (; off + 16 <= len; off += 16) {
+    __m128i va = _mm_loadu_si128((const __m128i *)(pa + off));
+    __m128i vb = _mm_loadu_si128((const __m128i *)(pb + off));
+    mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb));
+    if (mask != 0xFFFF)
+      return (int)((off + __builtin_ctz(~mask)) / sizeof(cell_t));
+  }
+
+  off /= sizeof(cell_t);
+  return (int)off + cellcmp_scalar(a + off, b + off, n - (int)off);
+}
+
+__attribute__((target("avx2")))
+static int cellcmp_avx2(const cell_t *a, const cell_t *b, int n) {
+  const char *pa = (const char *)a, *pb = (const char *)b;
+  size_t len = (size_t)n * sizeof(cell_t);
+  size_t off = 0;
+  unsigned m0, m1;
+
+  // 64 bytes per round; both halves are checked before bailing out
+  for (; off + 64 <= len; off += 64) {
+    __m256i a0 = _mm256_loadu_si256((const __m256i *)(pa + off));
+    __m256i b0 = _mm256_loadu_si256((const __m256i *)(pb + off));
+    __m256i a1 = _mm256_loadu_si256((const __m256i *)(pa + off + 32));
+    __m256i b1 = _mm256_loadu_si256((const __m256i *)(pb + off + 32));
+    m0 = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a0, b0));
+    m1 = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a1, b1));
+    if ((m0 & m1) != 0xFFFFFFFF) {
+      if (m0 != 0xFFFFFFFF)
+        return (int)((off + __builtin_ctz(~m0)) / sizeof(cell_t));
+      return (int)((off + 32 + __builtin_ctz(~m1)) / sizeof(cell_t));
+    }
+  }
+
+  for (; off + 32 <= len; off += 32) {
+    __m256i va = _mm256_loadu_si256((const __m256i *)(pa + off));
+    __m256i vb = _mm256_loadu_si256((const __m256i *)(pb + off));
+    m0 = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
+    if (m0 != 0xFFFFFFFF)
+      return (int)((off + __builtin_ctz(~m0)) / sizeof(cell_t));
+  }
+
+  off /= sizeof(cell_t);
+  return (int)off + cellcmp_scalar(a + off, b + off, n - (int)off);
+}
+
+#endif
+
+static int cellcmp_resolve(const cell_t *a, const cell_t *b, int n);
+
+/* Picks the widest kernel the CPU supports on first use. */
+static cellcmp_func cellcmp = cellcmp_resolve;
+
+static int cellcmp_resolve(const cell_t *a, const cell_t *b, int n) {
+  cellcmp = cellcmp_scalar;
+
+#ifdef CELLCMP_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    cellcmp = cellcmp_avx2;
+  else if (__builtin_cpu_supports("sse2"))
+    cellcmp = cellcmp_sse2;
+#endif
+
+  return cellcmp(a, b, n);
+}
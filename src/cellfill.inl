@@ -0,0 +1,86 @@
+// Fills runs of cells with copies of one cell. Eight cells (64 or 96 bytes,
+// depending on the cell layout) make a whole number of 16 and 32-byte
+// vectors, so the pattern is built once and then stored over and over, which
+// runs at about the speed of memset().
+
+#define CELLFILL_CELLS 8
+
+typedef void (*cellfill_func)(cell_t *cells, const cell_t *cell, int n);
+
+// sets cells[0..n) to *cell
+static void cellfill_scalar(cell_t *cells, const cell_t *cell, int n) {
+  int i;
+  for (i = 0; i < n; ++i)
+    cells[i] = *cell;
+}
+
+#ifdef CELLCMP_X86
+
+__attribute__((target("sse2")))
+static void cellfill_sse2(cell_t *cells, const cell_t *cell, int n) {
+  cell_t pattern[CELLFILL_CELLS];
+  __m128i v[sizeof(pattern) / 16];
+  char *p = (char *)cells;
+  unsigned k;
+  int i = 0;
+
+  if (n >= CELLFILL_CELLS * 2) {
+    for (k = 0; k < CELLFILL_CELLS; ++k)
+      pattern[k] = *cell;
+    for (k = 0; k < sizeof(pattern) / 16; ++k)
+      v[k] = _mm_loadu_si128((const __m128i *)pattern + k);
+
+    for (; i + CELLFILL_CELLS <= n; i += CELLFILL_CELLS) {
+      for (k = 0; k < sizeof(pattern) / 16; ++k)
+        _mm_storeu_si128((__m128i *)p + k, v[k]);
+      p += sizeof(pattern);
+    }
+  }
+
+  cellfill_scalar(cells + i, cell, n - i);
+}
+
+__attribute__((target("avx")))
+static void cellfill_avx(cell_t *cells, const cell_t *cell, int n) {
+  cell_t pattern[CELLFILL_CELLS];
+  __m256i v[sizeof(pattern) / 32];
+  char *p = (char *)cells;
+  unsigned k;
+  int i = 0;
+
+  if (n >= CELLFILL_CELLS * 2) {
+    for (k = 0; k < CELLFILL_CELLS; ++k)
+      pattern[k] = *cell;
+    for (k = 0; k < sizeof(pattern) / 32; ++k)
+      v[k] = _mm256_loadu_si256((const __m256i *)pattern + k);
+
+    for (; i + CELLFILL_CELLS <= n; i += CELLFILL_CELLS) {
+      for (k = 0; k < sizeof(pattern) / 32; ++k)
+        _mm256_storeu_si256((__m256i *)p + k, v[k]);
+      p += sizeof(pattern);
+    }
+  }
+
+  cellfill_scalar(cells + i, cell, n - i);
+}
+
+#endif
+
+static void cellfill_resolve(cell_t *cells, const cell_t *cell, int n);
+
+/* Picks the widest kernel the CPU supports on first use. */
+static cellfill_func cellfill = cellfill_resolve;
+
+static void cellfill_resolve(cell_t *cells, const cell_t *cell, int n) {
+  cellfill = cellfill_scalar;
+
+#ifdef CELLCMP_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx"))
+    cellfill = cellfill_avx;
+  else if (__builtin_cpu_supports("sse2"))
+    cellfill = cellfill_sse2;
+#endif
+
+  cellfill(cells, cell, n);
+}
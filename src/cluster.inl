@@ -0,0 +1,287 @@
+// Grapheme clusters of more than one code point don't fit in a tb_chr, so
+// cells hold TB_CLUSTER | id, where id numbers the cluster's UTF-8 kept in an
+// arena. Clusters are interned: the same one always gets the same id, and
+// cells still compare as plain words when diffing.
+
+#define CLUSTER_MAX_LEN 255 // bytes kept of a cluster, longer ones are cut
+#define CLUSTER_BLOCK (64 * 1024)
+#define MAX_CLUSTER_BLOCKS 1024
+#define CLUSTER_BLOCK_LIMIT_INIT 4
+#define CLUSTER_CHUNK_BITS 12
+#define CLUSTER_CHUNK (1 << CLUSTER_CHUNK_BITS)
+#define MAX_CLUSTER_CHUNKS 256
+#define CLUSTER_LIMIT_INIT 4096
+
+// never handed out, so a front buffer cell set to it is always redrawn
+#define CLUSTER_NONE 0xFFFFFFFF
+
+#define IS_CLUSTER(ch) ((ch) & TB_CLUSTER)
+#define CLUSTER_ID(ch) ((ch) & ~TB_CLUSTER)
+#define CLUSTER(ch) (&cluster_chunks[CLUSTER_ID(ch) >> CLUSTER_CHUNK_BITS][CLUSTER_ID(ch) & (CLUSTER_CHUNK - 1)])
+// whether a TB_CLUSTER char stands for a cluster that's kept now: callers can
+// pass any value, or one whose cluster was dropped since
+#define CLUSTER_HELD(ch) (CLUSTER_ID(ch) < cluster_top && CLUSTER(ch)->str)
+
+struct cluster {
+  const char *str; // NULL while the id is free
+  uint32_t hash;
+  uint8_t len;
+  uint8_t width;
+};
+
+/* As with styles, neither the entries nor the arena blocks move while the
+ * writer or band threads may be reading them. When either fills up, the
+ * clusters no cell refers to any more are dropped and the rest are packed
+ * into new blocks (see cluster_collect), with the writer drained first. Ids
+ * stay the same, so the back buffer is left as it is. */
+static struct cluster *cluster_chunks[MAX_CLUSTER_CHUNKS];
+static char *cluster_blocks[MAX_CLUSTER_BLOCKS];
+static int cluster_block_count = 0; // the last one is being filled
+static int cluster_block_used = CLUSTER_BLOCK; // bytes used of the last one
+static int cluster_block_limit = CLUSTER_BLOCK_LIMIT_INIT;
+
+static uint32_t cluster_top = 1; // ids below this were handed out (0 never is)
+static uint32_t cluster_limit = CLUSTER_LIMIT_INIT;
+static uint32_t *cluster_free = NULL; // ids dropped by cluster_collect()
+static uint32_t cluster_free_count = 0;
+
+// open addressing, from the UTF-8 to the id. 0 marks a free slot
+static uint32_t *cluster_index = NULL;
+static uint32_t cluster_index_size = 0;
+
+static uint32_t cluster_hash(const char *str, int len) {
+  uint32_t h = 2166136261u;
+  int i;
+
+  for (i = 0; i < len; ++i)
+    h = (h ^ (uint8_t)str[i]) * 16777619u;
+  return h;
+}
+
+static void cluster_index_add(uint32_t id) {
+  uint32_t mask = cluster_index_size - 1;
+  uint32_t i = CLUSTER(id)->hash & mask;
+
+  while (cluster_index[i])
+    i = (i + 1) & mask;
+  cluster_index[i] = id;
+}
+
+static void cluster_index_rebuild(uint32_t size) {
+  uint32_t id;
+
+  free(cluster_index);
+  cluster_index = (uint32_t*)calloc(size, sizeof(uint32_t));
+  assert(cluster_index);
+  cluster_index_size = size;
+
+  for (id = 1; id < cluster_top; ++id) {
+    if (CLUSTER(id)->str)
+      cluster_index_add(id);
+  }
+}
+
+// whether storing len more bytes needs a block over the limit
+static bool cluster_arena_full(int len) {
+  return cluster_block_used + len + 1 > CLUSTER_BLOCK && cluster_block_count == cluster_block_limit;
+}
+
+// copies str to the arena, NUL-terminated
+static const char *cluster_store(const char *str, int len) {
+  char *p;
+
+  if (cluster_block_used + len + 1 > CLUSTER_BLOCK) {
+    assert(cluster_block_count < MAX_CLUSTER_BLOCKS);
+    cluster_blocks[cluster_block_count] = (char*)malloc(CLUSTER_BLOCK);
+    assert(cluster_blocks[cluster_block_count]);
+    cluster_block_count++;
+    cluster_block_used = 0;
+  }
+
+  p = cluster_blocks[cluster_block_count - 1] + cluster_block_used;
+  memcpy(p, str, len);
+  p[len] = 0;
+  cluster_block_used += len + 1;
+  return p;
+}
+
+// flags the clusters held by n cells as live
+static void cluster_mark(const cell_t *cells, int n, uint8_t *live) {
+  tb_chr ch;
+  int i;
+
+  for (i = 0; i < n; ++i) {
+    ch = cells[i].ch;
+    if (IS_CLUSTER(ch) && CLUSTER_ID(ch) < cluster_top)
+      live[CLUSTER_ID(ch)] = 1;
+  }
+}
+
+/* Called when ids or arena space run out, from the main thread. Clusters in
+ * the back buffer, the layers and the composite are kept (and those in the
+ * tb_cell_buffer() mirror, which may be ahead of the back buffer). Front
+ * buffer cells holding a dropped one are set to CLUSTER_NONE, as the id may
+ * come back for something else. */
+static void cluster_collect(void) {
+  char *old[MAX_CLUSTER_BLOCKS];
+  int i, n, old_count = cluster_block_count;
+  uint8_t *live = (uint8_t*)calloc(cluster_top, 1);
+  struct cluster *cl;
+  uint32_t id, count = 0;
+  tb_chr ch;
+
+  assert(live);
+  writer_drain();
+
+  if (termw != -1) {
+    n = back_buffer.width * back_buffer.height;
+    cluster_mark(back_buffer.cells, n, live);
+    for (i = 0; i < layer_count; ++i)
+      cluster_mark(layer_order[i]->buf.cells, layer_order[i]->buf.width * layer_order[i]->buf.height, live);
+    if (comp_allocated)
+      cluster_mark(comp_buffer.cells, comp_buffer.width * comp_buffer.height, live);
+
+#ifdef COMPACT_CELLS
+    for (i = 0; cell_mirror && i < n; ++i) {
+      ch = cell_mirror[i].ch;
+      if (IS_CLUSTER(ch) && CLUSTER_ID(ch) < cluster_top)
+        live[CLUSTER_ID(ch)] = 1;
+    }
+#endif
+
+    n = front_buffer.width * front_buffer.height;
+    for (i = 0; i < n; ++i) {
+      ch = front_buffer.cells[i].ch;
+      if (IS_CLUSTER(ch) && !(CLUSTER_ID(ch) < cluster_top && live[CLUSTER_ID(ch)]))
+        front_buffer.cells[i].ch = CLUSTER_NONE;
+    }
+  }
+
+  // pack what's kept into new blocks
+  memcpy(old, cluster_blocks, sizeof(char*) * old_count);
+  cluster_block_count = 0;
+  cluster_block_used = CLUSTER_BLOCK;
+  cluster_free = (uint32_t*)realloc(cluster_free, sizeof(uint32_t) * cluster_top);
+  assert(cluster_free);
+  cluster_free_count = 0;
+
+  for (id = 1; id < cluster_top; ++id) {
+    cl = CLUSTER(id);
+    if (live[id]) {
+      cl->str = cluster_store(cl->str, cl->len);
+      count++;
+    } else {
+      cl->str = NULL;
+      cluster_free[cluster_free_count++] = id;
+    }
+  }
+
+  for (i = 0; i < old_count; ++i)
+    free(old[i]);
+
+  // mostly still in use, so give it more room before the next time
+  if (count > cluster_limit / 2 && cluster_limit < MAX_CLUSTER_CHUNKS * CLUSTER_CHUNK)
+    cluster_limit *= 2;
+  if (cluster_block_count > cluster_block_limit / 2 && cluster_block_limit < MAX_CLUSTER_BLOCKS)
+    cluster_block_limit *= 2;
+
+  cluster_index_rebuild(cluster_index_size);
+  free(live);
+}
+
+static void cluster_free_all(void) {
+  int i;
+
+  for (i = 0; i < MAX_CLUSTER_CHUNKS; ++i) {
+    free(cluster_chunks[i]);
+    cluster_chunks[i] = NULL;
+  }
+
+  for (i = 0; i < cluster_block_count; ++i)
+    free(cluster_blocks[i]);
+
+  free(cluster_free);
+  free(cluster_index);
+  cluster_free = cluster_index = NULL;
+  cluster_free_count = cluster_index_size = 0;
+  cluster_block_count = 0;
+  cluster_block_used = CLUSTER_BLOCK;
+  cluster_block_limit = CLUSTER_BLOCK_LIMIT_INIT;
+  cluster_top = 1;
+  cluster_limit = CLUSTER_LIMIT_INIT;
+}
+
+// returns the TB_CLUSTER char for the len bytes of str, which take 'width'
+// columns
+static tb_chr cluster_intern(const char *str, int len, int width) {
+  uint32_t h, i, id, mask;
+  struct cluster *cl;
+
+  if (len > CLUSTER_MAX_LEN) {
+    // cut at the last code point that fits
+    for (len = CLUSTER_MAX_LEN; len > 0 && (str[len] & 0xC0) == 0x80; --len);
+  }
+
+  if (!cluster_index)
+    cluster_index_rebuild(1024);
+
+  h = cluster_hash(str, len);
+  mask = cluster_index_size - 1;
+  for (i = h & mask; (id = cluster_index[i]); i = (i + 1) & mask) {
+    cl = CLUSTER(id);
+    if (cl->hash == h && cl->len == len && memcmp(cl->str, str, len) == 0)
+      return TB_CLUSTER | id;
+  }
+
+  if ((cluster_free_count == 0 && cluster_top == cluster_limit) || cluster_arena_full(len)) {
+    cluster_collect();
+
+    // every cluster is in use and neither limit can grow: keep the first
+    // code point alone
+    if ((cluster_free_count == 0 && cluster_top == cluster_limit) || cluster_arena_full(len)) {
+      tb_utf8_char_to_unicode(&id, str);
+      return id;
+    }
+    return cluster_intern(str, len, width);
+  }
+
+  if (cluster_free_count) {
+    id = cluster_free[--cluster_free_count];
+  } else {
+    id = cluster_top++;
+    if (!cluster_chunks[id >> CLUSTER_CHUNK_BITS]) {
+      cluster_chunks[id >> CLUSTER_CHUNK_BITS] = (struct cluster*)malloc(sizeof(struct cluster) * CLUSTER_CHUNK);
+      assert(cluster_chunks[id >> CLUSTER_CHUNK_BITS]);
+    }
+  }
+
+  cl = CLUSTER(id);
+  cl->str = cluster_store(str, len);
+  cl->hash = h;
+  cl->len = len;
+  cl->width = width;
+
+  // keep the index at most half full
+  if ((cluster_top - cluster_free_count) * 2 > cluster_index_size)
+    cluster_index_rebuild(cluster_index_size * 2);
+  else
+    cluster_index_add(id);
+
+  return TB_CLUSTER | id;
+}
+
+/* Reads the grapheme cluster at str into *ch, as a code point or a TB_CLUSTER
+ * char, and returns its length in bytes (0 at the end of the string). */
+static int read_cluster(const char *str, tb_chr *ch) {
+  int width, len = tb_utf8_grapheme_length(str, &width);
+
+  if (len == 0)
+    return 0;
+
+  if (len == tb_utf8_char_length(*str))
+    tb_utf8_char_to_unicode(ch, str);
+  else
+    *ch = cluster_intern(str, len, width);
+
+  return len;
+}
@@ -0,0 +1,182 @@
+// Performance overlay, for tb_show_hud(). It's sent straight to the terminal
+// once a frame has been diffed, so the back buffer (and the layers) never see
+// it. The front buffer goes on as if the frame was there instead, so only
+// what changes under the HUD is sent (and drawn over); once it moves or goes
+// away, the cells it covered are marked unknown and get redrawn.
+//
+// It shows the frame rate, the output queued ahead of the frame, and min, avg
+// and p99 of the render time and size of the last HUD_FRAMES frames. Turned
+// off, it costs a branch per frame.
+
+#define HUD_FRAMES 120
+#define HUD_WIDTH 29
+#define HUD_HEIGHT 4
+
+struct hudsample {
+  uint64_t interval; // since the frame before
+  uint64_t render_ns;
+  uint64_t bytes;
+};
+
+static int hud_corner = TB_HUD_OFF;
+static struct hudsample hud_samples[HUD_FRAMES];
+static int hud_count; // samples kept, up to HUD_FRAMES
+static int hud_next;  // slot for the next one
+
+// the frame being rendered
+static uint64_t hud_start;
+static uint64_t hud_last;   // when the frame before it was done
+static int hud_out_start;   // out->len when it started
+static int hud_streamed;    // bytes of it written out before the end
+static int hud_pending;     // bytes queued ahead of it
+
+// where it was drawn last, if it was
+static bool hud_shown;
+static int hud_x0, hud_y0, hud_x1, hud_y1;
+
+static int hud_cmp(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+  return x < y ? -1 : x > y;
+}
+
+// min, avg and p99 of one field of the samples, in order
+static void hud_spread(size_t field, uint64_t res[3]) {
+  uint64_t vals[HUD_FRAMES], sum = 0;
+  int i;
+
+  for (i = 0; i < hud_count; ++i) {
+    vals[i] = *(uint64_t*)((char*)&hud_samples[i] + field);
+    sum += vals[i];
+  }
+  qsort(vals, hud_count, sizeof(uint64_t), hud_cmp);
+
+  res[0] = vals[0];
+  res[1] = sum / hud_count;
+  res[2] = vals[(hud_count * 99 + 99) / 100 - 1];
+}
+
+// v, in at most 5 chars
+static void hud_num(char *buf, uint64_t v) {
+  if (v < 10000)
+    sprintf(buf, "%u", (unsigned)v);
+  else if (v < 100000)
+    sprintf(buf, "%.1fk", v / 1000.0);
+  else if (v < 10000000)
+    sprintf(buf, "%uk", (unsigned)(v / 1000));
+  else
+    sprintf(buf, "%uM", (unsigned)(v / 1000000));
+}
+
+static void hud_line(char *buf, const char *label, size_t field, uint64_t div) {
+  char n[3][16];
+  uint64_t res[3];
+  int i;
+
+  hud_spread(field, res);
+  for (i = 0; i < 3; ++i)
+    hud_num(n[i], res[i] / div);
+  sprintf(buf, " %-10s%5s %5s %5s", label, n[0], n[1], n[2]);
+}
+
+static void hud_begin(void) {
+  hud_start = clock_ns();
+  hud_out_start = out->len;
+  hud_streamed = 0;
+  // on the writer thread, the frame's prefix (already in out) and the frames
+  // queued behind it
+  if (out == &writer_output)
+    hud_pending = __atomic_load_n(&writer_queued, __ATOMIC_RELAXED);
+  else
+    hud_pending = out->len;
+}
+
+// where the HUD goes now, false if nowhere
+static bool hud_rect(int *x0, int *y0, int *x1, int *y1) {
+  int w = HUD_WIDTH, h = HUD_HEIGHT;
+
+  if (!hud_corner || !front_buffer.width || !front_buffer.height)
+    return false;
+
+  if (w > front_buffer.width) w = front_buffer.width;
+  if (h > front_buffer.height) h = front_buffer.height;
+  *x0 = hud_corner == TB_HUD_TOP_LEFT || hud_corner == TB_HUD_BOTTOM_LEFT ? 0 : front_buffer.width - w;
+  *y0 = hud_corner == TB_HUD_TOP_LEFT || hud_corner == TB_HUD_TOP_RIGHT ? 0 : front_buffer.height - h;
+  *x1 = *x0 + w - 1;
+  *y1 = *y0 + h - 1;
+  return true;
+}
+
+/* Before diffing src: if the HUD is no longer where it was drawn, forgets
+ * what's there (and next to it, for wide chars cut in half), so it's redrawn. */
+static void hud_move(struct cellbuf *src) {
+  int x0, y0, x1, y1, x, y;
+
+  if (hud_rect(&x0, &y0, &x1, &y1) && x0 == hud_x0 && y0 == hud_y0 && x1 == hud_x1 && y1 == hud_y1)
+    return;
+
+  x0 = hud_x0 > 0 ? hud_x0 - 1 : 0;
+  x1 = hud_x1 + 1 < front_buffer.width ? hud_x1 + 1 : front_buffer.width - 1;
+  y1 = hud_y1 < front_buffer.height ? hud_y1 : front_buffer.height - 1;
+  for (y = hud_y0; y <= y1; ++y) {
+    for (x = x0; x <= x1; ++x)
+      CELL(&front_buffer, x, y).ch = CLUSTER_NONE;
+  }
+  if (x0 <= x1 && hud_y0 <= y1)
+    cellbuf_mark_dirty(src, x0, hud_y0, x1, y1);
+
+  hud_shown = false;
+}
+
+/* Takes the numbers of the frame just rendered, and draws the HUD over it.
+ * Goes before render_end(), so the cursor ends up where it should. */
+static void hud_draw(void) {
+  struct hudsample *sample = &hud_samples[hud_next];
+  char lines[HUD_HEIGHT][64], n[16];
+  uint64_t now = clock_ns(), total = 0;
+  int x0, y0, x1, y1, x, y, i;
+
+  sample->interval = hud_last ? now - hud_last : 0;
+  sample->render_ns = now - hud_start;
+  sample->bytes = hud_streamed + out->len - hud_out_start;
+  hud_last = now;
+  hud_next = (hud_next + 1) % HUD_FRAMES;
+  if (hud_count < HUD_FRAMES)
+    hud_count++;
+
+  for (i = 0; i < hud_count; ++i)
+    total += hud_samples[i].interval;
+  // the first frame has no interval
+  i = hud_count < HUD_FRAMES ? hud_count - 1 : hud_count;
+
+  snprintf(lines[0], sizeof(lines[0]), " %5.1f fps   min   avg   p99", total ? i * 1e9 / total : 0.0);
+  hud_line(lines[1], "render us", offsetof(struct hudsample, render_ns), 1000);
+  hud_line(lines[2], "bytes", offsetof(struct hudsample, bytes), 1);
+  hud_num(n, hud_pending);
+  sprintf(lines[3], " %-10s%5s", "pending", n);
+
+  if (!hud_rect(&x0, &y0, &x1, &y1))
+    return;
+
+  set_colors(TB_WHITE, TB_BLUE);
+  for (y = y0; y <= y1; ++y) {
+    for (x = x0, i = 0; x <= x1; ++x)
+      send_char(x, y, lines[y - y0][i] ? lines[y - y0][i++] : ' ', 1);
+  }
+
+  hud_shown = true;
+  hud_x0 = x0;
+  hud_y0 = y0;
+  hud_x1 = x1;
+  hud_y1 = y1;
+}
+
+void tb_show_hud(int corner) {
+  writer_drain(); // it reads hud_corner
+
+  if (corner < TB_HUD_OFF || corner > TB_HUD_BOTTOM_RIGHT)
+    corner = TB_HUD_TOP_RIGHT;
+  if (corner != TB_HUD_OFF && hud_corner == TB_HUD_OFF)
+    hud_count = hud_next = hud_last = 0;
+
+  hud_corner = corner;
+}
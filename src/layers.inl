@@ -0,0 +1,385 @@
+// Layers stacked over the back buffer (tb_layer_create). Each one is a
+// cellbuf of its own, placed at an offset and ordered by z. While there are
+// any, tb_render() composites the parts of the screen that changed into
+// comp_buffer and renders that instead of the back buffer.
+
+#define MAX_LAYERS 32
+
+struct layer {
+  struct cellbuf buf;
+  int x;
+  int y;
+  int z;
+  int flags;
+  bool visible;
+  unsigned serial; // creation order, to break ties in z
+};
+
+static struct layer *layer_slots[MAX_LAYERS]; // by id - 1
+static struct layer *layer_order[MAX_LAYERS]; // bottom to top
+static int layer_count = 0;
+static unsigned layer_serial = 0;
+
+/* What the back buffer and the layers add up to. Allocated with the first
+ * layer, and kept (and resized along) from then on. */
+static struct cellbuf comp_buffer;
+static bool comp_allocated = false;
+
+// where each column of the row being composited comes from, see layer_at()
+static int *comp_src = NULL;
+
+/* where the drawing functions write to: the back buffer, or the selected
+ * layer's buffer (then draw_layer) */
+static struct cellbuf *draw_buffer = &back_buffer;
+static struct layer *draw_layer = NULL;
+
+// marks screen cells x0/y0..x1/y1 (inclusive, clipped) as needing a redraw
+static void comp_damage(int x0, int y0, int x1, int y1) {
+  struct cellbuf *buf = layer_count ? &comp_buffer : &back_buffer;
+
+  if (x0 < 0) x0 = 0;
+  if (y0 < 0) y0 = 0;
+  if (x1 >= buf->width)  x1 = buf->width - 1;
+  if (y1 >= buf->height) y1 = buf->height - 1;
+  if (x0 > x1 || y0 > y1)
+    return;
+
+  cellbuf_mark_dirty(buf, x0, y0, x1, y1);
+}
+
+// a column more each way, for wide chars cut in half by the layer's edges
+static void layer_damage(struct layer *l) {
+  if (l->visible)
+    comp_damage(l->x - 1, l->y, l->x + l->buf.width, l->y + l->buf.height - 1);
+}
+
+static struct layer *layer_get(int id) {
+  if (id < 1 || id > MAX_LAYERS)
+    return NULL;
+  return layer_slots[id - 1];
+}
+
+static bool layer_above(const struct layer *a, const struct layer *b) {
+  return a->z != b->z ? a->z > b->z : a->serial > b->serial;
+}
+
+// keeps layer_order sorted by z, layers with the same z in creation order
+static void layer_sort(void) {
+  struct layer *l;
+  int i, j;
+
+  for (i = 1; i < layer_count; ++i) {
+    l = layer_order[i];
+    for (j = i; j > 0 && layer_above(layer_order[j - 1], l); --j)
+      layer_order[j] = layer_order[j - 1];
+    layer_order[j] = l;
+  }
+}
+
+// clears a layer to transparent cells, or to blanks if it's opaque
+static void layer_clear(struct layer *l) {
+  struct tb_cell clear = {TB_TRANSPARENT, TB_DEFAULT, TB_DEFAULT};
+  cell_t blank;
+  int row;
+
+  if (l->flags & TB_LAYER_OPAQUE) {
+    clear.ch = ' ';
+    clear.fg = foreground;
+    clear.bg = background;
+  }
+
+  cell_pack(&blank, &clear);
+  for (row = 0; row < l->buf.height; ++row)
+    cellbuf_clear_row(&l->buf, row, 0, l->buf.width, &blank);
+  cellbuf_mark_dirty(&l->buf, 0, 0, l->buf.width - 1, l->buf.height - 1);
+}
+
+static void comp_resize(int width, int height) {
+  if (!comp_allocated) {
+    cellbuf_init(&comp_buffer, width, height);
+    cellbuf_clear(&comp_buffer);
+    comp_allocated = true;
+  } else {
+    cellbuf_resize(&comp_buffer, width, height);
+  }
+
+  comp_src = (int*)realloc(comp_src, sizeof(int) * (width + 2));
+  assert(comp_src);
+}
+
+/* Returns the index in layer_order of the topmost visible layer with
+ * something at screen x/y, or -1 for the back buffer. */
+static int layer_at(int x, int y) {
+  struct layer *l;
+  int i;
+
+  for (i = layer_count - 1; i >= 0; --i) {
+    l = layer_order[i];
+    if (!l->visible || x < l->x || y < l->y || x >= l->x + l->buf.width || y >= l->y + l->buf.height)
+      continue;
+    if ((l->flags & TB_LAYER_OPAQUE) || CELL(&l->buf, x - l->x, y - l->y).ch != TB_TRANSPARENT)
+      return i;
+  }
+
+  return -1;
+}
+
+/* Trims x0..x1 of screen row y by the opaque layers above layer_order[level]
+ * (or above the back buffer, for -1). Returns true when nothing is left. */
+static bool layer_occluded(int level, int y, int *x0, int *x1) {
+  struct layer *l;
+  int i, lx0, lx1;
+
+  for (i = level + 1; i < layer_count; ++i) {
+    l = layer_order[i];
+    if (!l->visible || !(l->flags & TB_LAYER_OPAQUE) || y < l->y || y >= l->y + l->buf.height)
+      continue;
+
+    lx0 = l->x;
+    lx1 = l->x + l->buf.width - 1;
+    if (lx0 <= *x0 && *x1 <= lx1)
+      return true;
+    if (lx0 <= *x0 && *x0 <= lx1)
+      *x0 = lx1 + 1;
+    else if (lx0 <= *x1 && *x1 <= lx1)
+      *x1 = lx0 - 1;
+  }
+
+  return false;
+}
+
+/* Moves the dirty spans of the back buffer and the layers over to the
+ * composite, leaving out what opaque layers above them cover. The spans grow
+ * by a column to the left, as whether a wide char shows depends on the cell
+ * after it, and to the right over any run of wide chars that follows: a
+ * change in width moves where the glyphs in such a run start. */
+static void layers_collect_damage(void) {
+  struct cellspan *span;
+  struct cellbuf *buf;
+  struct layer *l;
+  int i, y, ox, oy, x0, x1;
+
+  for (i = -1; i < layer_count; ++i) {
+    l = i < 0 ? NULL : layer_order[i];
+    buf = l ? &l->buf : &back_buffer;
+    ox = l ? l->x : 0;
+    oy = l ? l->y : 0;
+
+    for (y = 0; y < buf->height; ++y) {
+      span = &buf->dirty[y];
+      if (span->min > span->max)
+        continue;
+
+      if (span->stale)
+        cellbuf_update_widths(buf, y, span->min, span->max);
+
+      for (x1 = span->max + 1; x1 < buf->width && CELL_WIDTH(buf, x1, y) == 2; ++x1);
+      x0 = ox + span->min - 1;
+      x1 += ox;
+      cellbuf_mark_clean(buf, y);
+
+      if ((l && !l->visible) || oy + y < 0 || oy + y >= comp_buffer.height)
+        continue;
+      if (x0 < 0) x0 = 0;
+      if (x1 >= comp_buffer.width) x1 = comp_buffer.width - 1;
+
+      if (x0 <= x1 && !layer_occluded(i, oy + y, &x0, &x1))
+        cellbuf_mark_dirty(&comp_buffer, x0, oy + y, x1, oy + y);
+    }
+  }
+}
+
+/* Composites columns x0..x1 of screen row y. Each cell comes from the topmost
+ * layer with something there, so nothing under it is looked at. A wide char
+ * whose second column is covered by something else becomes a blank, and so
+ * does the second column of one whose first column is covered. */
+static void composite_row(int y, int x0, int x1) {
+  int a = x0 > 0 ? x0 - 1 : x0;
+  int b = x1 < comp_buffer.width - 1 ? x1 + 1 : x1;
+  int x, s, lx, ly, w;
+  struct cellbuf *buf;
+  cell_t *dst;
+
+  for (x = a; x <= b; ++x)
+    comp_src[x - a] = layer_at(x, y);
+
+  for (x = x0; x <= x1; ++x) {
+    s = comp_src[x - a];
+    buf = s < 0 ? &back_buffer : &layer_order[s]->buf;
+    lx = s < 0 ? x : x - layer_order[s]->x;
+    ly = s < 0 ? y : y - layer_order[s]->y;
+
+    dst = &CELL(&comp_buffer, x, y);
+    *dst = CELL(buf, lx, ly);
+    w = CELL_WIDTH(buf, lx, ly);
+
+    if (dst->ch == TB_TRANSPARENT) {
+      dst->ch = ' ';
+      w = 1;
+    } else if (w == 2 && x + 1 <= b && comp_src[x + 1 - a] != s) {
+      dst->ch = ' ';
+      w = 1;
+    } else if (lx > 0 && (x == 0 || comp_src[x - 1 - a] != s) && cellbuf_next_glyph(buf, 0, lx, ly) != lx) {
+      dst->ch = ' ';
+      w = 1;
+    }
+
+    CELL_WIDTH(&comp_buffer, x, y) = w;
+  }
+}
+
+/* Returns the buffer tb_render() should render: the back buffer when there
+ * are no layers, or else the composite, brought up to date. */
+static struct cellbuf *layers_composite(void) {
+  struct cellspan *span;
+  int y;
+
+  if (!layer_count)
+    return &back_buffer;
+
+  layers_collect_damage();
+
+  for (y = 0; y < comp_buffer.height; ++y) {
+    span = &comp_buffer.dirty[y];
+    if (span->min <= span->max)
+      composite_row(y, span->min, span->max);
+  }
+
+  return &comp_buffer;
+}
+
+static void layers_free(void) {
+  int i;
+
+  for (i = 0; i < MAX_LAYERS; ++i) {
+    if (layer_slots[i]) {
+      cellbuf_free(&layer_slots[i]->buf);
+      free(layer_slots[i]);
+      layer_slots[i] = NULL;
+    }
+  }
+
+  if (comp_allocated)
+    cellbuf_free(&comp_buffer);
+
+  free(comp_src);
+  comp_src = NULL;
+  comp_allocated = false;
+  layer_count = 0;
+  draw_buffer = &back_buffer;
+  draw_layer = NULL;
+}
+
+int tb_layer_create(int x, int y, int w, int h, int z, int flags) {
+  struct layer *l;
+  int id;
+
+  if (w <= 0 || h <= 0)
+    return -1;
+
+  for (id = 0; id < MAX_LAYERS && layer_slots[id]; ++id);
+  if (id == MAX_LAYERS)
+    return -1;
+
+  l = (struct layer*)malloc(sizeof(struct layer));
+  assert(l);
+  l->x = x;
+  l->y = y;
+  l->z = z;
+  l->flags = flags;
+  l->visible = true;
+  l->serial = layer_serial++;
+
+  cellbuf_init(&l->buf, w, h);
+  layer_clear(l);
+
+  if (!layer_count) {
+    // the composite may be out of date, or not be there yet
+    comp_resize(back_buffer.width, back_buffer.height);
+    cellbuf_mark_dirty(&comp_buffer, 0, 0, comp_buffer.width - 1, comp_buffer.height - 1);
+  }
+
+  layer_slots[id] = l;
+  layer_order[layer_count++] = l;
+  layer_sort();
+  layer_damage(l);
+  return id + 1;
+}
+
+void tb_layer_destroy(int layer) {
+  struct layer *l = layer_get(layer);
+  int i;
+
+  if (!l)
+    return;
+
+  if (draw_layer == l) {
+    draw_buffer = &back_buffer;
+    draw_layer = NULL;
+  }
+
+  for (i = 0; layer_order[i] != l; ++i);
+  for (; i < layer_count - 1; ++i)
+    layer_order[i] = layer_order[i + 1];
+  layer_count--;
+  layer_slots[layer - 1] = NULL;
+
+  // the back buffer is what gets rendered again after the last one, and
+  // whatever the composite had left to redraw still needs it
+  if (!layer_count) {
+    for (i = 0; i < comp_buffer.height; ++i) {
+      if (comp_buffer.dirty[i].min <= comp_buffer.dirty[i].max)
+        cellbuf_mark_dirty(&back_buffer, comp_buffer.dirty[i].min, i, comp_buffer.dirty[i].max, i);
+      cellbuf_mark_clean(&comp_buffer, i);
+    }
+  }
+
+  layer_damage(l);
+  cellbuf_free(&l->buf);
+  free(l);
+}
+
+void tb_layer_move(int layer, int x, int y) {
+  struct layer *l = layer_get(layer);
+
+  if (!l || (l->x == x && l->y == y))
+    return;
+
+  layer_damage(l);
+  l->x = x;
+  l->y = y;
+  layer_damage(l);
+}
+
+void tb_layer_set_z(int layer, int z) {
+  struct layer *l = layer_get(layer);
+
+  if (!l || l->z == z)
+    return;
+
+  l->z = z;
+  layer_sort();
+  layer_damage(l);
+}
+
+void tb_layer_show(int layer, int show) {
+  struct layer *l = layer_get(layer);
+
+  if (!l || l->visible == !!show)
+    return;
+
+  l->visible = true;
+  layer_damage(l);
+  l->visible = !!show;
+}
+
+int tb_select_layer(int layer) {
+  struct layer *l = layer_get(layer);
+
+  if (layer != 0 && !l)
+    return -1;
+
+  draw_buffer = l ? &l->buf : &back_buffer;
+  draw_layer = l;
+  return 0;
+}
@@ -0,0 +1,125 @@
+// Render statistics, for tb_get_stats(). The renderer counts what it does in
+// its renderstate (each band has its own), and the counts go into 'stats'
+// once the frame has been written out. Output is counted as it's flushed,
+// and belongs to the frame it goes out with. Built without WITH_STATS, the
+// STAT() lines vanish and nothing is counted.
+
+#include <pthread.h>
+#include <time.h>
+
+#ifdef WITH_STATS
+#define STAT(x) x
+#else
+#define STAT(x)
+#endif
+
+struct renderstats {
+  uint64_t cells_scanned;
+  uint64_t cells_changed;
+  uint64_t cursor_moves;
+  uint64_t sgr_sequences;
+};
+
+// monotonic time in nanoseconds, for the stats, traces and the HUD
+static uint64_t clock_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+#ifdef WITH_STATS
+
+/* The writer thread finishes frames while the main thread may be reading
+ * them, hence the lock. Flushes never overlap (see writer_drain), so
+ * stats_pending is only ever written by one thread at a time. */
+static struct tb_stats stats;
+static struct tb_frame_stats stats_pending; // output since the last frame
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// timing of the frame being rendered, on whichever thread renders it
+static uint64_t stats_render_start;
+static uint64_t stats_render_ns;
+static uint64_t stats_flush_mark;
+
+static void stats_add(struct tb_frame_stats *dst, const struct tb_frame_stats *src) {
+  dst->cells_scanned += src->cells_scanned;
+  dst->cells_changed += src->cells_changed;
+  dst->bytes += src->bytes;
+  dst->cursor_moves += src->cursor_moves;
+  dst->sgr_sequences += src->sgr_sequences;
+  dst->writes += src->writes;
+  dst->flush_ns += src->flush_ns;
+  dst->render_ns += src->render_ns;
+}
+
+static void renderstats_add(struct renderstats *dst, const struct renderstats *src) {
+  dst->cells_scanned += src->cells_scanned;
+  dst->cells_changed += src->cells_changed;
+  dst->cursor_moves += src->cursor_moves;
+  dst->sgr_sequences += src->sgr_sequences;
+}
+
+static void stats_output(int bytes, int writes, uint64_t ns) {
+  pthread_mutex_lock(&stats_lock);
+  stats_pending.bytes += bytes;
+  stats_pending.writes += writes;
+  stats_pending.flush_ns += ns;
+  pthread_mutex_unlock(&stats_lock);
+}
+
+static void stats_render_begin(void) {
+  stats_render_start = clock_ns();
+  stats_flush_mark = stats_pending.flush_ns;
+}
+
+// time spent flushing mid-frame (see stream_output) isn't rendering
+static void stats_render_end(void) {
+  stats_render_ns = clock_ns() - stats_render_start - (stats_pending.flush_ns - stats_flush_mark);
+}
+
+/* Called once a frame is out, with what rendering it took. counts is NULL
+ * for a frame the writer dropped (it was for an older size). */
+static void stats_frame(const struct renderstats *counts) {
+  pthread_mutex_lock(&stats_lock);
+  stats.last = stats_pending;
+  if (counts) {
+    stats.last.cells_scanned = counts->cells_scanned;
+    stats.last.cells_changed = counts->cells_changed;
+    stats.last.cursor_moves = counts->cursor_moves;
+    stats.last.sgr_sequences = counts->sgr_sequences;
+    stats.last.render_ns = stats_render_ns;
+  }
+  stats_add(&stats.total, &stats.last);
+  stats.frames++;
+  memset(&stats_pending, 0, sizeof(stats_pending));
+  pthread_mutex_unlock(&stats_lock);
+}
+
+static void stats_resize(void) {
+  pthread_mutex_lock(&stats_lock);
+  stats.resizes++;
+  pthread_mutex_unlock(&stats_lock);
+}
+
+static void stats_reset(void) {
+  pthread_mutex_lock(&stats_lock);
+  memset(&stats, 0, sizeof(stats));
+  memset(&stats_pending, 0, sizeof(stats_pending));
+  pthread_mutex_unlock(&stats_lock);
+}
+
+int tb_get_stats(struct tb_stats *out_stats) {
+  pthread_mutex_lock(&stats_lock);
+  *out_stats = stats;
+  pthread_mutex_unlock(&stats_lock);
+  return 0;
+}
+
+#else
+
+int tb_get_stats(struct tb_stats *out_stats) {
+  memset(out_stats, 0, sizeof(*out_stats));
+  return -1;
+}
+
+#endif
@@ -29,8 +29,20 @@ enum {
 #define ENTER_MOUSE_SEQ "\x1b[?1000h\x1b[?1002h\x1b[?1015h\x1b[?1006h"
 #define EXIT_MOUSE_SEQ "\x1b[?1006l\x1b[?1015l\x1b[?1002l\x1b[?1000l"
 
+// synchronized output (mode 2026). terminals that don't know it ignore it.
+#define BEGIN_SYNC_SEQ "\x1b[?2026h"
+#define END_SYNC_SEQ "\x1b[?2026l"
+
 #define EUNSUPPORTED_TERM -1
 
+// optional capabilities the renderer can take advantage of. the sequences
+// themselves are the standard ANSI ones, we only need to know whether the
+// terminal understands them.
+#define CAP_REP 0x01 // repeat last char (CSI n b)
+#define CAP_ECH 0x02 // erase n chars (CSI n X)
+#define CAP_EL  0x04 // erase to end of line (CSI K)
+#define CAP_BCE 0x08 // erased cells take the current background color
+
 // rxvt-256color
 static const char *rxvt_256color_keys[] = {
   "\033[11~","\033[12~","\033[13~","\033[14~","\033[15~","\033[17~","\033[18~","\033[19~","\033[20~","\033[21~","\033[23~","\033[24~","\033[2~","\033[3~","\033[7~","\033[8~","\033[5~","\033[6~","\033[D","\033[C","\033[B","\033[A", 0
@@ -79,30 +91,39 @@ static const char *xterm_funcs[] = {
   "\033[?1049h", "\033[?1049l", "\033[?12l\033[?25h", "\033[?25l", "\033[H\033[2J", "\033(B\033[m", "\033[4m", "\033[1m", "\033[5m", "\033[7m", "\033[?1h\033=", "\033[?1l\033>", ENTER_MOUSE_SEQ, EXIT_MOUSE_SEQ,
 };
 
+#define RXVT_CAPS   (CAP_ECH | CAP_EL | CAP_BCE)
+#define ETERM_CAPS  (CAP_ECH | CAP_EL | CAP_BCE)
+#define SCREEN_CAPS (CAP_EL)
+#define LINUX_CAPS  (CAP_ECH | CAP_EL | CAP_BCE)
+#define XTERM_CAPS  (CAP_REP | CAP_ECH | CAP_EL | CAP_BCE)
+
 static struct term {
   const char *name;
   const char **keys;
   const char **funcs;
+  int caps;
 } terms[] = {
-  {"rxvt-256color", rxvt_256color_keys, rxvt_256color_funcs},
-  {"Eterm", eterm_keys, eterm_funcs},
-  {"screen", screen_keys, screen_funcs},
-  {"rxvt-unicode", rxvt_unicode_keys, rxvt_unicode_funcs},
-  {"linux", linux_keys, linux_funcs},
-  {"xterm", xterm_keys, xterm_funcs},
-  {0, 0, 0},
+  {"rxvt-256color", rxvt_256color_keys, rxvt_256color_funcs, RXVT_CAPS},
+  {"Eterm", eterm_keys, eterm_funcs, ETERM_CAPS},
+  {"screen", screen_keys, screen_funcs, SCREEN_CAPS},
+  {"rxvt-unicode", rxvt_unicode_keys, rxvt_unicode_funcs, RXVT_CAPS},
+  {"linux", linux_keys, linux_funcs, LINUX_CAPS},
+  {"xterm", xterm_keys, xterm_funcs, XTERM_CAPS},
+  {0, 0, 0, 0},
 };
 
 static bool init_from_terminfo = false;
 static const char **keys;
 static const char **funcs;
+static int caps;
 static const char * term_name;
 
 static int try_compatible(const char *term, const char *name,
-        const char **tkeys, const char **tfuncs) {
+        const char **tkeys, const char **tfuncs, int tcaps) {
   if (strstr(term, name)) {
     keys = tkeys;
     funcs = tfuncs;
+    caps = tcaps;
     return 0;
   }
 
@@ -119,23 +140,24 @@ static int init_term_builtin(void) {
       if (!strcmp(terms[i].name, term)) {
         keys = terms[i].keys;
         funcs = terms[i].funcs;
+        caps = terms[i].caps;
         return 0;
       }
     }
 
     /* let's do some heuristic, maybe it's a compatible terminal */
-    if (try_compatible(term, "xterm", xterm_keys, xterm_funcs) == 0)
+    if (try_compatible(term, "xterm", xterm_keys, xterm_funcs, XTERM_CAPS) == 0)
       return 0;
-    if (try_compatible(term, "rxvt", rxvt_unicode_keys, rxvt_unicode_funcs) == 0)
+    if (try_compatible(term, "rxvt", rxvt_unicode_keys, rxvt_unicode_funcs, RXVT_CAPS) == 0)
       return 0;
-    if (try_compatible(term, "linux", linux_keys, linux_funcs) == 0)
+    if (try_compatible(term, "linux", linux_keys, linux_funcs, LINUX_CAPS) == 0)
       return 0;
-    if (try_compatible(term, "Eterm", eterm_keys, eterm_funcs) == 0)
+    if (try_compatible(term, "Eterm", eterm_keys, eterm_funcs, ETERM_CAPS) == 0)
       return 0;
-    if (try_compatible(term, "screen", screen_keys, screen_funcs) == 0)
+    if (try_compatible(term, "screen", screen_keys, screen_funcs, SCREEN_CAPS) == 0)
       return 0;
     /* let's assume that 'cygwin' is xterm compatible */
-    if (try_compatible(term, "cygwin", xterm_keys, xterm_funcs) == 0)
+    if (try_compatible(term, "cygwin", xterm_keys, xterm_funcs, XTERM_CAPS) == 0)
       return 0;
   }
 
@@ -145,7 +167,7 @@ static int init_term_builtin(void) {
 static bool detect_color_support() {
 #ifdef WITH_TRUECOLOR
   const char *colorterm = getenv("COLORTERM");
-  if (colorterm && ((strcmp(colorterm) == "truecolor") == 0) || (strcmp(colorterm, "24bit") == 0)) {
+  if (colorterm && (strcmp(colorterm, "truecolor") == 0 || strcmp(colorterm, "24bit") == 0)) {
     return 2; // true color support
   }
 #endif
@@ -269,6 +291,18 @@ static const int16_t ti_funcs[] = {
   28, 40, 16, 13, 5, 39, 36, 27, 26, 34, 89, 88,
 };
 
+// el, ech and rep strings, and the bce boolean
+#define TI_CLR_EOL     6
+#define TI_ERASE_CHARS 37
+#define TI_REPEAT_CHAR 121
+#define TI_BCE         28
+
+static bool terminfo_has_string(char *data, int strings_offset, int count, int str) {
+  if (str >= count)
+    return false;
+  return *(int16_t*)(data + strings_offset + 2 * str) >= 0;
+}
+
 static const int16_t ti_keys[] = {
   66, 68 /* apparently not a typo; 67 is F10 for whatever reason */, 69,
   70, 71, 72, 73, 74, 75, 67, 216, 217, 77, 59, 76, 164, 82, 81, 79, 83,
@@ -331,6 +365,25 @@ static void parse_terminfo(char * data) {
   keys[TB_KEYS_NUM] = 0;
   funcs[T_FUNCS_NUM-2] = ENTER_MOUSE_SEQ;
   funcs[T_FUNCS_NUM-1] = EXIT_MOUSE_SEQ;
+
+  caps = 0;
+  if (terminfo_has_string(data, strings_offset, strOffCount, TI_CLR_EOL))
+    caps |= CAP_EL;
+  if (terminfo_has_string(data, strings_offset, strOffCount, TI_ERASE_CHARS))
+    caps |= CAP_ECH;
+  if (terminfo_has_string(data, strings_offset, strOffCount, TI_REPEAT_CHAR))
+    caps |= CAP_REP;
+  if (TI_BCE < boolsSize && data[TI_HEADER_LENGTH + namesSize + TI_BCE] == 1)
+    caps |= CAP_BCE;
+}
+
+// for when there's no telling what the terminal is, like running headless
+static void init_term_xterm(void) {
+  init_from_terminfo = false;
+  term_name = "xterm";
+  keys = xterm_keys;
+  funcs = xterm_funcs;
+  caps = XTERM_CAPS;
 }
 
 static int init_term(void) {
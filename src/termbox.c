@@ -7,6 +7,7 @@
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdarg.h>
@@ -14,23 +15,47 @@
 #include <sys/select.h>
 #include <sys/ioctl.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <sys/stat.h>
 #include <termios.h>
 #include <unistd.h>
-#include <wchar.h>
 
 #include "termbox.h"
 #include "bytebuffer.inl"
+#include "cell.inl"
+#include "cellcmp.inl"
+#include "cellfill.inl"
 #include "term.inl"
 #include "input.inl"
+#include "stats.inl"
+#include "trace.inl"
+
+/* Per-row span of columns written since the last tb_render(). A row is clean
+ * when min > max. Rows are stale when cells in the span were written through
+ * tb_cell_buffer(), so their widths have to be worked out again. */
+struct cellspan {
+  int min;
+  int max;
+  bool stale;
+};
 
+/* Rows are stored back to back, as tb_cell_buffer() hands the cells out as a
+ * plain width * height array. The arrays are allocated for 'capacity' cells
+ * and 'rows' rows, so resizing within that doesn't allocate. */
 struct cellbuf {
   int width;
   int height;
-  struct tb_cell *cells;
+  int capacity;
+  int rows;
+  cell_t *cells; // cache line aligned
+  uint8_t *widths; // columns each cell takes, as given by char_width()
+  struct cellspan *dirty;
 };
 
+#define CACHE_LINE 64
+
 #define CELL(buf, x, y) (buf)->cells[(y) * (buf)->width + (x)]
+#define CELL_WIDTH(buf, x, y) (buf)->widths[(y) * (buf)->width + (x)]
 #define IS_CURSOR_HIDDEN(cx, cy) (cx == -1 || cy == -1)
 #define LAST_COORD_INIT -1
 
@@ -38,9 +63,33 @@ static struct termios orig_tios;
 
 static struct cellbuf back_buffer;
 static struct cellbuf front_buffer;
+
+#ifdef COMPACT_CELLS
+/* What tb_cell_buffer() hands out, as the back buffer has no struct tb_cell
+ * to point to. Allocated on the first call, and from then on kept in step
+ * with the back buffer. Stale rows are copied over before rendering. */
+static struct tb_cell *cell_mirror = NULL;
+static int cell_mirror_size = 0; // in cells
+
+static void mirror_fill(void);
+static void mirror_sync(void);
+#endif
 static struct bytebuffer output_buffer;
 static struct bytebuffer input_buffer;
 
+/* where the renderer writes to. output_buffer, except on the writer thread */
+static __thread struct bytebuffer *out = &output_buffer;
+
+/* The output buffers start out this big, and are trimmed back to it after
+ * a spike. Going over the high-water mark (tb_set_output_limit) flushes them
+ * on the spot, even halfway through a frame. */
+#define OUTPUT_BASELINE (32 * 1024)
+#define OUTPUT_HIGH_WATER (256 * 1024)
+
+// tb_send() payloads from this size on (images and the like) are written
+// straight from the caller's memory
+#define SEND_DIRECT_MIN (16 * 1024)
+
 #define MAX_LIMIT 512
 static char print_buf[MAX_LIMIT];
 
@@ -53,8 +102,48 @@ static int initflags = TB_INIT_ALL;
 static int inout;
 static int winch_fds[2];
 
-static int lastx = LAST_COORD_INIT;
-static int lasty = LAST_COORD_INIT;
+/* Running without a terminal (tb_init_headless): output goes to the sink, or
+ * if there's none, piles up in headless_output until taken. */
+static bool headless = false;
+static tb_output_sink headless_sink = NULL;
+static void *headless_data = NULL;
+static struct bytebuffer headless_output;
+
+static int orig_fl = -1; // file status flags of inout, while we set O_NONBLOCK
+static int output_high_water = OUTPUT_HIGH_WATER;
+
+/* where the frame being rendered starts in 'out', or -1 once part of it has
+ * been flushed. Only one thread renders frames at a time */
+static int frame_start;
+
+#define SGR_DEFAULT   -1
+#define SGR_UNKNOWN   -2
+
+/* What the renderer knows about the terminal: where the cursor was left by the
+ * last char sent (or LAST_COORD_INIT when we can't tell), and the colors it
+ * has set, so set_colors() only needs to send what changes. Colors are the
+ * values written in the sequence (after mapping to the output mode), or
+ * SGR_DEFAULT. */
+struct renderstate {
+  int lastx;
+  int lasty;
+  tb_color lastfg;
+  tb_color lastbg;
+  int sgr_attrs;
+  int sgr_fg;
+  int sgr_bg;
+  int cursor_bytes_saved;
+  struct renderstats counts; // of the frame being rendered, for tb_get_stats()
+};
+
+static struct renderstate render_state = {
+  LAST_COORD_INIT, LAST_COORD_INIT, LAST_ATTR_INIT, LAST_ATTR_INIT,
+  SGR_UNKNOWN, SGR_DEFAULT, SGR_DEFAULT, 0, { 0 }
+};
+
+/* the state matching what's in 'out'. render_state, except on band workers */
+static __thread struct renderstate *rstate = &render_state;
+
 static int cursor_x = -1;
 static int cursor_y = -1;
 
@@ -68,17 +157,41 @@ static void write_title(const char * title);
 static void cellbuf_init(struct cellbuf *buf, int width, int height);
 static void cellbuf_resize(struct cellbuf *buf, int width, int height);
 static void cellbuf_clear(struct cellbuf *buf);
+static void cellbuf_clear_row(struct cellbuf *buf, int y, int x0, int x1, const cell_t *blank);
 static void cellbuf_free(struct cellbuf *buf);
+static void cellbuf_mark_dirty(struct cellbuf *buf, int x0, int y0, int x1, int y1);
+static void cellbuf_mark_clean(struct cellbuf *buf, int y);
+static void cellbuf_mark_stale(struct cellbuf *buf, int x0, int y0, int x1, int y1);
+static void cellbuf_update_widths(struct cellbuf *buf, int y, int x0, int x1);
+static int cellbuf_next_glyph(struct cellbuf *buf, int from, int x, int y);
+static int char_width(tb_chr ch);
 
 static void update_term_size(void);
 static void set_colors(tb_color fg, tb_color bg);
-static void send_char(int x, int y, uint32_t c);
+static void invalidate_colors(void);
+static void move_cursor(int x, int y);
+static void send_char(int x, int y, uint32_t c, int w);
+static int send_run(struct cellbuf *src, int x, int y);
+static void render_span(struct cellbuf *src, int y, int from, int to);
+static void render_begin(void);
+static void render_end(int cx, int cy);
+static int write_output(struct bytebuffer *b, bool wait, const char *data, int len);
+static int flush_buffer(struct bytebuffer *b, bool wait);
+static void stream_output(void);
+static void render_handoff(struct cellbuf *src);
+static int flush_output(void);
 static void sigwinch_handler(int xxx);
 static int wait_fill_event(struct tb_event *event, struct timeval *timeout);
 
 /* may happen in a different thread */
 static volatile int buffer_size_change_request;
 
+#include "writer.inl"
+#include "bands.inl"
+#include "layers.inl"
+#include "cluster.inl"
+#include "hud.inl"
+
 /* -------------------------------------------------------- */
 
 int tb_init_fd(int inout_) {
@@ -122,7 +235,11 @@ int tb_init_fd(int inout_) {
 
 int tb_init_screen(int flags) {
   bytebuffer_init(&input_buffer, 128);
-  bytebuffer_init(&output_buffer, 32 * 1024);
+  bytebuffer_init(&output_buffer, OUTPUT_BASELINE);
+  STAT(stats_reset());
+  trace_start();
+  if (getenv("TB_HUD"))
+    tb_show_hud(atoi(getenv("TB_HUD")));
 
   initflags = flags;
 
@@ -139,7 +256,7 @@ int tb_init_screen(int flags) {
     bytebuffer_puts(&output_buffer, funcs[T_ENTER_CA]);
     tb_clear_screen(); // flushes output
   } else {
-    bytebuffer_flush(&output_buffer, inout);
+    write_output(&output_buffer, true, NULL, 0);
   }
 
   update_term_size();
@@ -147,6 +264,7 @@ int tb_init_screen(int flags) {
   cellbuf_init(&front_buffer, termw, termh);
   cellbuf_clear(&back_buffer);
   cellbuf_clear(&front_buffer);
+  cellbuf_mark_dirty(&back_buffer, 0, 0, back_buffer.width-1, back_buffer.height-1);
 
   return 0;
 }
@@ -169,15 +287,56 @@ int tb_init(void) {
   return tb_init_screen(TB_INIT_ALL);
 }
 
+int tb_init_headless(int width, int height, int flags, tb_output_sink sink, void *data) {
+  if (width <= 0 || height <= 0)
+    return TB_EFAILED_TO_OPEN_TTY;
+
+  // TERM still picks the escape sequences, if it names something we know
+  if (init_term() < 0)
+    init_term_xterm();
+
+  // nothing ever writes to it, it's just there for tb_peek_event() to wait on
+  if (pipe(winch_fds) < 0) {
+    shutdown_term();
+    return TB_EPIPE_TRAP_ERROR;
+  }
+
+  headless = true;
+  headless_sink = sink;
+  headless_data = data;
+  if (!sink)
+    bytebuffer_init(&headless_output, OUTPUT_BASELINE);
+
+  inout = -1;
+  termw = width;
+  termh = height;
+  return tb_init_screen(flags);
+}
+
+const char *tb_headless_output(int *len) {
+  writer_drain();
+  *len = headless_output.len;
+  return headless_output.buf;
+}
+
+void tb_headless_clear_output(void) {
+  writer_drain();
+  bytebuffer_clear(&headless_output);
+}
+
 void tb_shutdown(void) {
   if (termw == -1) {
     fputs("term not initialized.", stderr);
     return;
   }
 
+  writer_shutdown();
+  bands_shutdown();
+
   if (title_set) write_title("");
   tb_show_cursor();
   bytebuffer_puts(&output_buffer, funcs[T_SGR0]); // reset attrs
+  invalidate_colors();
 
   if (initflags & TB_INIT_ALTSCREEN) {
     bytebuffer_puts(&output_buffer, funcs[T_EXIT_CA]);
@@ -191,81 +350,113 @@ void tb_shutdown(void) {
     bytebuffer_puts(&output_buffer, funcs[T_EXIT_KEYPAD]);
 
   bytebuffer_puts(&output_buffer, funcs[T_EXIT_MOUSE]);
-  bytebuffer_flush(&output_buffer, inout);
-  tcsetattr(inout, TCSAFLUSH, &orig_tios);
+  write_output(&output_buffer, true, NULL, 0);
+  tb_set_nonblocking_output(0);
+  if (!headless) {
+    tcsetattr(inout, TCSAFLUSH, &orig_tios);
+    close(inout);
+  }
 
   shutdown_term();
-  close(inout);
   close(winch_fds[0]);
   close(winch_fds[1]);
 
+  layers_free();
   cellbuf_free(&back_buffer);
   cellbuf_free(&front_buffer);
+#ifdef COMPACT_CELLS
+  free(cell_mirror);
+  cell_mirror = NULL;
+  cell_mirror_size = 0;
+  styles_free();
+#endif
+  cluster_free_all();
   bytebuffer_free(&output_buffer);
   bytebuffer_free(&input_buffer);
+  if (headless && !headless_sink)
+    bytebuffer_free(&headless_output);
+  trace_dump();
+  hud_corner = TB_HUD_OFF;
+  hud_shown = false;
+  headless = false;
+  output_mode = TB_OUTPUT_NORMAL; // tb_select_output_mode() can't go back to it
   termw = termh = -1;
 }
 
 void tb_render(void) {
-  int x,y,w,i;
-  struct tb_cell *back, *front;
-
-  /* invalidate cursor position */
-  lastx = LAST_COORD_INIT;
-  lasty = LAST_COORD_INIT;
+  struct cellbuf *src;
+  uint64_t start = trace_begin();
 
   if (buffer_size_change_request)
     tb_resize();
 
-  for (y = 0; y < front_buffer.height; ++y) {
-    for (x = 0; x < front_buffer.width; ) {
-
-      // get back and front cells for x/y position
-      back = &CELL(&back_buffer, x, y);
-      front = &CELL(&front_buffer, x, y);
+#ifdef COMPACT_CELLS
+  mirror_sync();
+#endif
 
-      // get width of char
-      w = wcwidth(back->ch); // tb_unicode_is_char_wide(back->ch) ? 2 : 1;
-      if (w < 1) w = 1;
+  src = layers_composite();
 
-      // if back cell hasn't changed, then skip to next one
-      if (memcmp(back, front, sizeof(struct tb_cell)) == 0) {
-        x += w;
-        continue;
-      }
+  if (writer_running) {
+    render_handoff(src);
+  } else {
+    render_begin();
+    if (hud_shown)
+      hud_move(src);
+    if (!render_bands(src, false))
+      render_rows(src, 0, front_buffer.height, false);
+    if (hud_corner)
+      hud_draw();
+    render_end(cursor_x, cursor_y);
+    flush_output();
+    STAT(stats_frame(&rstate->counts));
+  }
 
-      // copy back cell to front and set attributes
-      memcpy(front, back, sizeof(struct tb_cell));
-      set_colors(back->fg, back->bg);
+  trace_end("tb_render", start);
+}
 
-      // if we have a wide char, but x position + char width would exceed screen width
-      if (w == 2 && x >= front_buffer.width-1) {
+int tb_enable_render_thread(void) {
+  return writer_start();
+}
 
-        send_char(x, y, ' ');
+void tb_disable_render_thread(void) {
+  writer_shutdown();
+}
 
-      // otherwise, if we have a regular char or if there's enough room
-      } else {
+int tb_set_render_threads(int n) {
+  writer_drain();
+  return bands_start(n);
+}
 
-        // then send the char
-        send_char(x, y, back->ch);
+int tb_set_nonblocking_output(int enable) {
+  int fl;
 
-        // and empty the following cells, if needed (wide char)
-        for (i = 1; i < w; ++i) {
-          front = &CELL(&front_buffer, x + i, y);
-          front->ch = 0;
-          front->fg = back->fg;
-          front->bg = back->bg;
-        }
-      }
+  if (headless) // never blocks anyway
+    return 0;
 
-      x += w;
-    }
+  if (enable && orig_fl == -1) {
+    if ((fl = fcntl(inout, F_GETFL)) == -1)
+      return -1;
+    if (!(fl & O_NONBLOCK) && fcntl(inout, F_SETFL, fl | O_NONBLOCK) == -1)
+      return -1;
+    orig_fl = fl;
+  } else if (!enable && orig_fl != -1) {
+    writer_drain();
+    write_output(&output_buffer, true, NULL, 0);
+    fcntl(inout, F_SETFL, orig_fl);
+    orig_fl = -1;
   }
 
-  if (!IS_CURSOR_HIDDEN(cursor_x, cursor_y))
-    write_cursor(cursor_x, cursor_y);
+  return 0;
+}
 
-  bytebuffer_flush(&output_buffer, inout);
+int tb_pending_output(void) {
+  if (writer_running)
+    return output_buffer.len + __atomic_load_n(&writer_queued, __ATOMIC_RELAXED);
+  return output_buffer.len;
+}
+
+void tb_set_output_limit(int bytes) {
+  output_high_water = bytes > 0 ? bytes : 0;
 }
 
 void tb_set_cursor(int cx, int cy) {
@@ -288,11 +479,25 @@ void tb_set_title(const char * title) {
 }
 
 void tb_flush(void) {
-  bytebuffer_flush(&output_buffer, inout);
+  flush_output();
 }
 
 void tb_send(const char * str) {
-  bytebuffer_puts(&output_buffer, str); // same as append but without length
+  int len = strlen(str);
+
+  if (len < SEND_DIRECT_MIN) {
+    bytebuffer_append(&output_buffer, str, len);
+    if (output_high_water && output_buffer.len >= output_high_water) {
+      writer_drain();
+      flush_buffer(&output_buffer, true);
+    }
+    return;
+  }
+
+  // a big one goes out now, along with what was queued before it, rather
+  // than being copied into the buffer first
+  writer_drain();
+  write_output(&output_buffer, orig_fl == -1, str, len);
 }
 
 void tb_sendf(const char * fmt, ...) {
@@ -303,14 +508,30 @@ void tb_sendf(const char * fmt, ...) {
   return tb_send(print_buf);
 }
 
-void tb_cell(int x, int y, const struct tb_cell *cell) {
-  if ((unsigned)x >= (unsigned)back_buffer.width)
-    return;
+// puts a cell in the back buffer (or the selected layer) if x/y is within
+// it, and returns its width
+static int set_cell(int x, int y, const struct tb_cell *cell) {
+  struct cellbuf *buf = draw_buffer;
+  int w = char_width(cell->ch);
 
-  if ((unsigned)y >= (unsigned)back_buffer.height)
-    return;
+  if ((unsigned)x >= (unsigned)buf->width)
+    return w;
+
+  if ((unsigned)y >= (unsigned)buf->height)
+    return w;
+
+  cell_pack(&CELL(buf, x, y), cell);
+  CELL_WIDTH(buf, x, y) = w;
+#ifdef COMPACT_CELLS
+  if (cell_mirror && buf == &back_buffer)
+    cell_mirror[y * buf->width + x] = *cell;
+#endif
+  cellbuf_mark_dirty(buf, x, y, x, y);
+  return w;
+}
 
-  CELL(&back_buffer, x, y) = *cell;
+void tb_cell(int x, int y, const struct tb_cell *cell) {
+  set_cell(x, y, cell);
 }
 
 void tb_char(int x, int y, tb_color fg, tb_color bg, tb_chr ch) {
@@ -323,17 +544,33 @@ int tb_string_with_limit(int x, int y, tb_color fg, tb_color bg, const char *str
   int w, c = 0, l = 0;
 
   while (*str && l < limit) {
-    str += tb_utf8_char_to_unicode(&uni, str);
-    tb_char(x, y, fg, bg, uni);
-    w = tb_unicode_is_char_wide(uni) ? 2 : 1;
+    str += read_cluster(str, &uni);
+    struct tb_cell cell = {uni, fg, bg};
+    w = set_cell(x, y, &cell);
     c++;
-    x++;
+    x += w;
     l = l + w;
   }
 
   return l;
 }
 
+tb_chr tb_cluster(const char *str) {
+  tb_chr ch = ' ';
+
+  read_cluster(str, &ch);
+  return ch;
+}
+
+const char *tb_cluster_str(tb_chr ch, int *len) {
+  if (!IS_CLUSTER(ch) || !CLUSTER_HELD(ch))
+    return NULL;
+
+  if (len)
+    *len = CLUSTER(ch)->len;
+  return CLUSTER(ch)->str;
+}
+
 int tb_string(int x, int y, tb_color fg, tb_color bg, const char *str) {
   return tb_string_with_limit(x, y, fg, bg, str, MAX_LIMIT);
 }
@@ -347,23 +584,117 @@ int tb_stringf(int x, int y, tb_color fg, tb_color bg, const char *fmt, ...) {
 }
 
 void tb_empty(int x, int y, tb_color bg, int width) {
-  sprintf(print_buf, "%*s", width, "");
-  tb_string_with_limit(x, y, TB_DEFAULT, bg, print_buf, width);
+  struct tb_cell blank = {' ', TB_DEFAULT, bg};
+  tb_fill_rect(x, y, width, 1, &blank);
+}
+
+void tb_fill_rect(int x, int y, int w, int h, const struct tb_cell *cell) {
+  struct cellbuf *buf = draw_buffer;
+  int cw = char_width(cell->ch), row;
+  cell_t packed;
+
+  if (x < 0) { w += x; x = 0; }
+  if (y < 0) { h += y; y = 0; }
+  if (x + w > buf->width)  w = buf->width - x;
+  if (y + h > buf->height) h = buf->height - y;
+  if (w <= 0 || h <= 0)
+    return;
+
+  cell_pack(&packed, cell);
+  for (row = y; row < y + h; ++row) {
+    cellfill(&CELL(buf, x, row), &packed, w);
+    memset(&CELL_WIDTH(buf, x, row), cw, w);
+  }
+
+#ifdef COMPACT_CELLS
+  if (cell_mirror && buf == &back_buffer) {
+    int i;
+    for (row = y; row < y + h; ++row)
+      for (i = x; i < x + w; ++i)
+        cell_mirror[row * buf->width + i] = *cell;
+  }
+#endif
+
+  cellbuf_mark_dirty(buf, x, y, x + w - 1, y + h - 1);
+}
+
+void tb_blit(int x, int y, int w, int h, const struct tb_cell *src, int src_stride) {
+  struct cellbuf *buf = draw_buffer;
+  int row;
+
+  if (x < 0) { src -= x; w += x; x = 0; }
+  if (y < 0) { src -= (long)y * src_stride; h += y; y = 0; }
+  if (x + w > buf->width)  w = buf->width - x;
+  if (y + h > buf->height) h = buf->height - y;
+  if (w <= 0 || h <= 0)
+    return;
+
+  for (row = y; row < y + h; ++row, src += src_stride) {
+#ifdef COMPACT_CELLS
+    int i;
+
+    // mirror_sync() packs whatever goes to the mirror
+    if (cell_mirror && buf == &back_buffer) {
+      memcpy(&cell_mirror[row * buf->width + x], src, sizeof(struct tb_cell) * w);
+      continue;
+    }
+    for (i = 0; i < w; ++i)
+      cell_pack(&CELL(buf, x + i, row), &src[i]);
+#else
+    memcpy(&CELL(buf, x, row), src, sizeof(cell_t) * w);
+#endif
+  }
+
+  // the widths get worked out when rendering
+  cellbuf_mark_stale(buf, x, y, x + w - 1, y + h - 1);
 }
 
 struct tb_cell *tb_cell_buffer(void) {
+  // we can't tell what the caller is going to write, so assume everything
+  cellbuf_mark_stale(&back_buffer, 0, 0, back_buffer.width-1, back_buffer.height-1);
+#ifdef COMPACT_CELLS
+  if (!cell_mirror)
+    mirror_fill();
+  return cell_mirror;
+#else
   return back_buffer.cells;
+#endif
+}
+
+void tb_mark_dirty(int x, int y, int w, int h) {
+  if (x < 0) { w += x; x = 0; }
+  if (y < 0) { h += y; y = 0; }
+  if (x + w > back_buffer.width)  w = back_buffer.width - x;
+  if (y + h > back_buffer.height) h = back_buffer.height - y;
+  if (w <= 0 || h <= 0)
+    return;
+
+  cellbuf_mark_stale(&back_buffer, x, y, x + w - 1, y + h - 1);
+}
+
+int tb_cursor_bytes_saved(void) {
+  return render_state.cursor_bytes_saved;
 }
 
 int tb_poll_event(struct tb_event *event) {
-  return wait_fill_event(event, 0);
+  uint64_t start = trace_begin();
+  int ret = wait_fill_event(event, 0);
+
+  trace_end("wait_fill_event", start);
+  return ret;
 }
 
 int tb_peek_event(struct tb_event *event, int timeout) {
   struct timeval tv;
+  uint64_t start = trace_begin();
+  int ret;
+
   tv.tv_sec = timeout / 1000;
   tv.tv_usec = (timeout - (tv.tv_sec * 1000)) * 1000;
-  return wait_fill_event(event, &tv);
+  ret = wait_fill_event(event, &tv);
+
+  trace_end("wait_fill_event", start);
+  return ret;
 }
 
 int tb_width(void) {
@@ -384,16 +715,20 @@ void tb_show_cursor(void) {
 
 void tb_enable_mouse(void) {
   bytebuffer_puts(&output_buffer, funcs[T_ENTER_MOUSE]);
-  bytebuffer_flush(&output_buffer, inout);
+  flush_output();
 }
 
 void tb_disable_mouse(void) {
   bytebuffer_puts(&output_buffer, funcs[T_EXIT_MOUSE]);
-  bytebuffer_flush(&output_buffer, inout);
+  flush_output();
 }
 
 int tb_select_output_mode(int mode) {
-  if (mode) output_mode = mode;
+  if (mode && mode != output_mode) {
+    writer_drain();
+    output_mode = mode;
+    invalidate_colors(); // same colors will be written differently now
+  }
   return output_mode;
 }
 
@@ -403,94 +738,591 @@ void tb_set_clear_attributes(tb_color fg, tb_color bg) {
 }
 
 void tb_clear_screen(void) {
+  writer_drain();
   set_colors(foreground, background);
   bytebuffer_puts(&output_buffer, funcs[T_CLEAR_SCREEN]);
 
   if (!IS_CURSOR_HIDDEN(cursor_x, cursor_y))
     write_cursor(cursor_x, cursor_y);
 
-  bytebuffer_flush(&output_buffer, inout);
+  flush_output();
 
   /* we need to invalidate cursor position too and these two vars are
    * used only for simple cursor positioning optimization, cursor
    * actually may be in the correct place, but we simply discard
    * optimization once and it gives us simple solution for the case when
    * cursor moved */
-  lastx = LAST_COORD_INIT;
-  lasty = LAST_COORD_INIT;
+  rstate->lastx = LAST_COORD_INIT;
+  rstate->lasty = LAST_COORD_INIT;
 }
 
 void tb_clear_buffer(void) {
   if (buffer_size_change_request)
     tb_resize();
 
+  if (draw_layer) {
+    layer_clear(draw_layer);
+    return;
+  }
+
   cellbuf_clear(&back_buffer);
+  cellbuf_mark_dirty(&back_buffer, 0, 0, back_buffer.width-1, back_buffer.height-1);
+#ifdef COMPACT_CELLS
+  if (cell_mirror)
+    mirror_fill();
+#endif
 }
 
 void tb_resize(void) {
+  uint64_t start = trace_begin();
+
+  writer_drain(); // the front buffer is about to change under it
+  STAT(stats_resize());
+
   if (buffer_size_change_request) {
     buffer_size_change_request = 0;
   } else {
     update_term_size();
   }
 
+#ifdef COMPACT_CELLS
+  mirror_sync(); // keep what was written through it
+#endif
+
   cellbuf_resize(&back_buffer, termw, termh);
   cellbuf_resize(&front_buffer, termw, termh);
   cellbuf_clear(&front_buffer);
+#ifdef COMPACT_CELLS
+  if (cell_mirror)
+    mirror_fill();
+#endif
+  // widths too, in case tb_set_char_width() was called
+  cellbuf_mark_stale(&back_buffer, 0, 0, back_buffer.width-1, back_buffer.height-1);
+
+  if (layer_count) {
+    comp_resize(termw, termh);
+    cellbuf_mark_dirty(&comp_buffer, 0, 0, termw - 1, termh - 1);
+  }
 
   tb_clear_screen();
+  trace_end("tb_resize", start);
 }
 
 /* -------------------------------------------------------- */
 
+// allocates room for 'capacity' cells and 'rows' rows, leaving them as they are
+static void cellbuf_alloc(struct cellbuf *buf, int capacity, int rows) {
+  void *cells;
+
+  // checked for real, as 'cells' is left unset when it fails
+  if (posix_memalign(&cells, CACHE_LINE, sizeof(cell_t) * capacity) != 0)
+    abort();
+  buf->cells = (cell_t*)cells;
+  buf->widths = (uint8_t*)malloc(capacity);
+  assert(buf->widths);
+  buf->dirty = (struct cellspan*)malloc(sizeof(struct cellspan) * rows);
+  assert(buf->dirty);
+  buf->capacity = capacity;
+  buf->rows = rows;
+}
+
 static void cellbuf_init(struct cellbuf *buf, int width, int height) {
-  buf->cells = (struct tb_cell*)malloc(sizeof(struct tb_cell) * width * height);
-  assert(buf->cells);
+  int y;
+
+  cellbuf_alloc(buf, width * height, height);
   buf->width = width;
   buf->height = height;
+
+  for (y = 0; y < height; ++y)
+    cellbuf_mark_clean(buf, y);
+}
+
+// fills columns x0..x1 (exclusive) of row y with blank
+static void cellbuf_clear_row(struct cellbuf *buf, int y, int x0, int x1, const cell_t *blank) {
+  cellfill(&CELL(buf, x0, y), blank, x1 - x0);
+  memset(&CELL_WIDTH(buf, x0, y), 1, x1 - x0);
 }
 
+/* Keeps what fits of the old contents at their x/y, and clears the rest. Only
+ * allocates when the new size doesn't fit, and then with room to spare so a
+ * window being dragged bigger doesn't allocate at every step. Otherwise rows
+ * are moved in place: from the bottom up when they get wider (each moves
+ * forward, past the rows still to be moved) and from the top down when they
+ * get narrower. */
 static void cellbuf_resize(struct cellbuf *buf, int width, int height) {
-  if (buf->width == width && buf->height == height)
+  int oldw = buf->width, oldh = buf->height, y, from, to, step;
+  int minw = (width < oldw) ? width : oldw;
+  int minh = (height < oldh) ? height : oldh;
+  int capacity = buf->capacity + buf->capacity / 2;
+  int rows = buf->rows + buf->rows / 2;
+  struct cellbuf old = *buf;
+  struct tb_cell clear = {' ', foreground, background};
+  cell_t blank;
+
+  if (oldw == width && oldh == height)
     return;
 
-  int oldw = buf->width;
-  int oldh = buf->height;
-  struct tb_cell *oldcells = buf->cells;
+  // before anything moves, as packing it may renumber styles (styles_collect)
+  cell_pack(&blank, &clear);
 
-  cellbuf_init(buf, width, height);
-  cellbuf_clear(buf);
+  if (width * height > buf->capacity || height > buf->rows) {
+    if (capacity < width * height) capacity = width * height;
+    if (rows < height) rows = height;
+    cellbuf_alloc(buf, capacity, rows);
+  }
 
-  int minw = (width < oldw) ? width : oldw;
-  int minh = (height < oldh) ? height : oldh;
-  int i;
+  buf->width = width;
+  buf->height = height;
 
-  for (i = 0; i < minh; ++i) {
-    struct tb_cell *csrc = oldcells + (i * oldw);
-    struct tb_cell *cdst = buf->cells + (i * width);
-    memcpy(cdst, csrc, sizeof(struct tb_cell) * minw);
+  if (width > oldw) {
+    from = minh - 1; to = -1; step = -1;
+  } else {
+    from = 0; to = minh; step = 1;
+  }
+
+  for (y = from; y != to; y += step) {
+    memmove(&CELL(buf, 0, y), &old.cells[y * oldw], sizeof(cell_t) * minw);
+    memmove(&CELL_WIDTH(buf, 0, y), &old.widths[y * oldw], minw);
+    cellbuf_clear_row(buf, y, minw, width, &blank);
   }
 
-  free(oldcells);
+  for (y = minh; y < height; ++y)
+    cellbuf_clear_row(buf, y, 0, width, &blank);
+
+  for (y = 0; y < height; ++y)
+    cellbuf_mark_clean(buf, y);
+
+  if (buf->cells != old.cells)
+    cellbuf_free(&old);
 }
 
 static void cellbuf_clear(struct cellbuf *buf) {
-  int i;
+  struct tb_cell clear = {' ', foreground, background};
   int ncells = buf->width * buf->height;
+  cell_t blank;
 
-  for (i = 0; i < ncells; ++i) {
-    buf->cells[i].ch = ' ';
-    buf->cells[i].fg = foreground;
-    buf->cells[i].bg = background;
-  }
+  cell_pack(&blank, &clear);
+  cellfill(buf->cells, &blank, ncells);
+  memset(buf->widths, 1, ncells);
 }
 
 static void cellbuf_free(struct cellbuf *buf) {
   free(buf->cells);
+  free(buf->widths);
+  free(buf->dirty);
+}
+
+// x0/y0 and x1/y1 are inclusive and must be within the buffer
+static void cellbuf_mark_dirty(struct cellbuf *buf, int x0, int y0, int x1, int y1) {
+  struct cellspan *span;
+
+  for (; y0 <= y1; ++y0) {
+    span = &buf->dirty[y0];
+    if (x0 < span->min) span->min = x0;
+    if (x1 > span->max) span->max = x1;
+  }
+}
+
+static void cellbuf_mark_clean(struct cellbuf *buf, int y) {
+  buf->dirty[y].min = buf->width;
+  buf->dirty[y].max = -1;
+  buf->dirty[y].stale = false;
+}
+
+// same as cellbuf_mark_dirty(), for cells written without updating widths
+static void cellbuf_mark_stale(struct cellbuf *buf, int x0, int y0, int x1, int y1) {
+  int y;
+
+  cellbuf_mark_dirty(buf, x0, y0, x1, y1);
+  for (y = y0; y <= y1; ++y)
+    buf->dirty[y].stale = true;
+}
+
+static void cellbuf_update_widths(struct cellbuf *buf, int y, int x0, int x1) {
+  for (; x0 <= x1; ++x0)
+    CELL_WIDTH(buf, x0, y) = char_width(CELL(buf, x0, y).ch);
+}
+
+#ifdef COMPACT_CELLS
+
+// (re)sizes the mirror to the back buffer and copies it over
+static void mirror_fill(void) {
+  int i, n = back_buffer.width * back_buffer.height;
+
+  // the caller may still hold it, so it only moves when the size changes
+  if (n != cell_mirror_size) {
+    cell_mirror = (struct tb_cell*)realloc(cell_mirror, sizeof(struct tb_cell) * n);
+    assert(cell_mirror);
+    cell_mirror_size = n;
+  }
+
+  for (i = 0; i < n; ++i)
+    cell_unpack(&cell_mirror[i], &back_buffer.cells[i]);
+}
+
+// copies what may have been written through the mirror to the back buffer
+static void mirror_sync(void) {
+  struct cellspan *span;
+  int x, y;
+
+  if (!cell_mirror)
+    return;
+
+  for (y = 0; y < back_buffer.height; ++y) {
+    span = &back_buffer.dirty[y];
+    if (!span->stale)
+      continue;
+
+    for (x = span->min; x <= span->max; ++x)
+      cell_pack(&CELL(&back_buffer, x, y), &cell_mirror[y * back_buffer.width + x]);
+  }
+}
+
+// gives the styles of n cells their new numbers, adding them as they come
+static void styles_keep(cell_t *cells, int n, const struct style *old, uint32_t *remap) {
+  cell_t *cell;
+  int i;
+
+  for (i = 0; i < n; ++i) {
+    cell = &cells[i];
+    if (cell->style != STYLE_NONE && remap[cell->style] == STYLE_NONE)
+      remap[cell->style] = style_add(old[cell->style].fg, old[cell->style].bg);
+    cell->style = remap[cell->style];
+  }
+}
+
+/* Called by style_intern() when the table is full. Keeps the styles used in
+ * the back buffer, numbered anew. Front buffer cells whose style goes get
+ * STYLE_NONE, which is fine as they differ from the back buffer already. The
+ * writer is drained first, being the only other thread reading the table. */
+static void styles_collect(void) {
+  uint32_t count = style_count, id, *remap;
+  struct style *old;
+  cell_t *cell;
+  int i, n;
+
+  writer_drain();
+
+  old = (struct style*)malloc(sizeof(struct style) * count);
+  remap = (uint32_t*)calloc(count, sizeof(uint32_t));
+  assert(old && remap);
+
+  for (id = 0; id < count; ++id)
+    old[id] = *STYLE(id);
+
+  styles_reset();
+
+  styles_keep(back_buffer.cells, back_buffer.width * back_buffer.height, old, remap);
+  for (i = 0; i < layer_count; ++i)
+    styles_keep(layer_order[i]->buf.cells, layer_order[i]->buf.width * layer_order[i]->buf.height, old, remap);
+  if (comp_allocated)
+    styles_keep(comp_buffer.cells, comp_buffer.width * comp_buffer.height, old, remap);
+
+  // the two can differ in size halfway through tb_resize()
+  n = front_buffer.width * front_buffer.height;
+  for (i = 0; i < n; ++i) {
+    cell = &front_buffer.cells[i];
+    cell->style = remap[cell->style];
+  }
+
+  // mostly still in use, so give it more room before the next time
+  if (style_count > style_limit / 2 && style_limit < MAX_STYLE_CHUNKS * STYLE_CHUNK)
+    style_limit *= 2;
+
+  free(old);
+  free(remap);
+}
+
+#endif
+
+/* The renderer walks each row left to right, stepping over the second half of
+ * wide chars. Given that column 'from' is where a char starts, this returns
+ * the first column at or after x where the walk would land. Any run of wide
+ * chars right before x decides it: the cell before such a run is narrow, so
+ * the walk always steps on the cell right after it, whatever came earlier. */
+static int cellbuf_next_glyph(struct cellbuf *buf, int from, int x, int y) {
+  int start = x;
+
+  while (start > from && CELL_WIDTH(buf, start - 1, y) == 2)
+    start--;
+
+  return ((x - start) & 1) ? x + 1 : x;
+}
+
+static int char_width(tb_chr ch) {
+  int w;
+
+  if (ch >= 0x20 && ch < 0x7F)
+    return 1;
+
+  if (IS_CLUSTER(ch))
+    return CLUSTER_HELD(ch) ? CLUSTER(ch)->width : 1;
+
+  w = tb_unicode_char_width(ch);
+  return w < 1 ? 1 : w;
+}
+
+/* Diffs columns from..to (inclusive) of row y of src (the back buffer, or a
+ * copy of it) against the front buffer and sends whatever changed. Whenever a
+ * cell is sent the span is stretched to include the next one, as a char
+ * changing width shifts what follows it. */
+static void render_span(struct cellbuf *src, int y, int from, int to) {
+  int x, w, i, end, start;
+  cell_t *back, *front;
+
+  end = to + 1;
+  if (end > front_buffer.width)
+    end = front_buffer.width;
+
+  x = start = cellbuf_next_glyph(src, 0, from, y);
+
+  while (x < end) {
+
+    // skip ahead to the next cell that differs from the front buffer
+    i = x + cellcmp(&CELL(src, x, y), &CELL(&front_buffer, x, y), end - x);
+    if (i == end)
+      break;
+
+    // and make sure it's not the second half of a wide char
+    x = cellbuf_next_glyph(src, x, i, y);
+    if (x != i)
+      continue;
+
+    // get back and front cells for x/y position
+    back = &CELL(src, x, y);
+    front = &CELL(&front_buffer, x, y);
+
+    // get width of char
+    w = CELL_WIDTH(src, x, y);
+
+    // copy back cell to front and set attributes
+    *front = *back;
+    set_colors(CELL_FG(back), CELL_BG(back));
+
+    // if we have a wide char, but x position + char width would exceed screen width
+    if (w == 2 && x >= front_buffer.width-1) {
+
+      send_char(x, y, ' ', 1);
+
+    // if it starts a run of identical cells, try to send them all at once
+    } else if (w == 1 && (i = send_run(src, x, y)) > 0) {
+
+      w = i;
+
+    // otherwise, if we have a regular char or if there's enough room
+    } else {
+
+      // then send the char
+      send_char(x, y, back->ch, w);
+
+      // and empty the following cells, if needed (wide char)
+      for (i = 1; i < w; ++i) {
+        front = &CELL(&front_buffer, x + i, y);
+        *front = *back;
+        front->ch = 0;
+      }
+    }
+
+    STAT(rstate->counts.cells_changed += w);
+    x += w;
+    if (end < x + 1 && x < front_buffer.width)
+      end = x + 1;
+  }
+
+  STAT(rstate->counts.cells_scanned += (x < end ? end : x) - start);
+}
+
+/* Renders rows y0..y1 (exclusive) of src: their dirty spans, or all of each
+ * row when the spans can't be trusted. */
+static void render_rows(struct cellbuf *src, int y0, int y1, bool all) {
+  struct cellspan *span;
+  int y;
+
+  for (y = y0; y < y1; ++y) {
+    if (all) {
+      render_span(src, y, 0, front_buffer.width - 1);
+      stream_output();
+      continue;
+    }
+
+    span = &src->dirty[y];
+    if (span->min > span->max)
+      continue;
+
+    if (span->stale)
+      cellbuf_update_widths(src, y, span->min, span->max);
+
+    render_span(src, y, span->min, span->max);
+    cellbuf_mark_clean(src, y);
+    stream_output();
+  }
+}
+
+static void render_begin(void) {
+  /* invalidate cursor position */
+  rstate->lastx = LAST_COORD_INIT;
+  rstate->lasty = LAST_COORD_INIT;
+  rstate->cursor_bytes_saved = 0;
+  STAT(memset(&rstate->counts, 0, sizeof(rstate->counts)));
+  STAT(stats_render_begin());
+  if (hud_corner)
+    hud_begin();
+
+  if (initflags & TB_INIT_SYNC_OUTPUT)
+    bytebuffer_puts(out, BEGIN_SYNC_SEQ);
+
+  frame_start = out->len;
+}
+
+static void render_end(int cx, int cy) {
+  if (!IS_CURSOR_HIDDEN(cx, cy))
+    write_cursor(cx, cy);
+
+  if (initflags & TB_INIT_SYNC_OUTPUT) {
+    if (out->len == frame_start) // nothing to wrap
+      out->len -= sizeof(BEGIN_SYNC_SEQ) - 1;
+    else
+      bytebuffer_puts(out, END_SYNC_SEQ);
+  }
+
+  STAT(stats_render_end());
+}
+
+// hands a copy of src (the back buffer or the composite), and whatever was
+// queued, to the writer
+static void render_handoff(struct cellbuf *src) {
+  int y, n = src->width * src->height;
+  struct cellspan *span;
+  struct frame *frame = writer_acquire();
+
+  for (y = 0; y < src->height; ++y) {
+    span = &src->dirty[y];
+    if (span->stale)
+      cellbuf_update_widths(src, y, span->min, span->max);
+    cellbuf_mark_clean(src, y);
+  }
+
+  cellbuf_resize(&frame->buf, src->width, src->height);
+
+  memcpy(frame->buf.cells, src->cells, sizeof(cell_t) * n);
+  memcpy(frame->buf.widths, src->widths, n);
+
+  writer_queue(output_buffer.len);
+  if (frame->prefix.len == 0)
+    bytebuffer_swap(&frame->prefix, &output_buffer);
+  else
+    bytebuffer_append(&frame->prefix, output_buffer.buf, output_buffer.len);
+  bytebuffer_clear(&output_buffer);
+
+  frame->cursor_x = cursor_x;
+  frame->cursor_y = cursor_y;
+  writer_publish(frame);
+}
+
+/* Runs on the writer thread. Frames can be dropped, so the dirty spans they
+ * were made from mean nothing here and every row is diffed. */
+static void render_frame(struct frame *frame) {
+  uint64_t start = trace_begin();
+
+  out = &writer_output; // always empty here, as it's flushed with 'wait'
+  bytebuffer_swap(out, &frame->prefix);
+  bytebuffer_clear(&frame->prefix);
+  writer_counted = out->len; // since render_handoff()
+
+  if (frame->buf.width == front_buffer.width && frame->buf.height == front_buffer.height) {
+    render_begin();
+    if (hud_shown)
+      hud_move(&frame->buf);
+    if (!render_bands(&frame->buf, true))
+      render_rows(&frame->buf, 0, front_buffer.height, true);
+    if (hud_corner)
+      hud_draw();
+    render_end(frame->cursor_x, frame->cursor_y);
+    flush_buffer(out, true); // blocking here is what the thread is for
+    STAT(stats_frame(&rstate->counts));
+  } else {
+    flush_buffer(out, true);
+    STAT(stats_frame(NULL));
+  }
+
+  trace_end("render_frame", start);
+}
+
+/* Writes out b and then len bytes of data, to the terminal or (headless) the
+ * sink. Returns how much of b is left, or -1 on errors. */
+static int write_output(struct bytebuffer *b, bool wait, const char *data, int len) {
+  STAT(int total = b->len + len);
+  STAT(unsigned writes = bytebuffer_writes);
+  STAT(uint64_t start = clock_ns());
+  uint64_t traced = trace_begin();
+
+  if (!headless) {
+    int left = bytebuffer_flush_with(b, inout, wait, data, len);
+    STAT(stats_output(left < 0 ? 0 : total - left, bytebuffer_writes - writes, clock_ns() - start));
+    trace_end("write_output", traced);
+    return left;
+  }
+
+  if (headless_sink) {
+    if (b->len)
+      headless_sink(b->buf, b->len, headless_data);
+    if (len)
+      headless_sink(data, len, headless_data);
+    STAT(writes = (b->len > 0) + (len > 0));
+  } else {
+    bytebuffer_append(&headless_output, b->buf, b->len);
+    if (len)
+      bytebuffer_append(&headless_output, data, len);
+    STAT(writes = 1);
+  }
+  STAT(stats_output(total, writes, clock_ns() - start));
+  trace_end("write_output", traced);
+
+  bytebuffer_clear(b);
+  return 0;
+}
+
+// writes out b, giving memory back if it grew for a spike
+static int flush_buffer(struct bytebuffer *b, bool wait) {
+  int used = b->len, left;
+
+  if (b == &writer_output)
+    writer_sending();
+  left = write_output(b, wait, NULL, 0);
+  if (b == &writer_output)
+    writer_sent();
+
+  bytebuffer_trim(b, used, OUTPUT_BASELINE);
+  return left;
+}
+
+/* Writes out what the main thread has queued, once the writer is done. With
+ * non-blocking output whatever the terminal doesn't take stays queued. */
+static int flush_output(void) {
+  writer_drain();
+  return flush_buffer(&output_buffer, orig_fl == -1);
+}
+
+/* Flushes the frame being rendered so far, if it has grown past the
+ * high-water mark. This waits for the terminal even in non-blocking mode, as
+ * the point is to keep the buffer from growing. Band workers leave theirs
+ * alone, as it goes out after the bands before it. */
+static void stream_output(void) {
+  if (!output_high_water || out->len < output_high_water || rstate != &render_state)
+    return;
+
+  if (hud_corner)
+    hud_streamed += out->len;
+  flush_buffer(out, true);
+  frame_start = -1;
 }
 
 static void update_term_size(void) {
   struct winsize sz;
+
+  if (headless) // the size given to tb_init_headless() stays
+    return;
+
   memset(&sz, 0, sizeof(sz));
   ioctl(inout, TIOCGWINSZ, &sz);
 
@@ -565,9 +1397,36 @@ tb_color tb_rgb(uint32_t in) {
   }
 }
 
-static int convertnum(uint8_t num, char* buf) {
+// decimal strings for 0-255, padded to 4 bytes so they can be copied whole
+static const char digits[256][4] = {
+  "0", "1", "2", "3", "4", "5", "6", "7", "8", "9", "10", "11", "12", "13", "14", "15",
+  "16", "17", "18", "19", "20", "21", "22", "23", "24", "25", "26", "27", "28", "29", "30", "31",
+  "32", "33", "34", "35", "36", "37", "38", "39", "40", "41", "42", "43", "44", "45", "46", "47",
+  "48", "49", "50", "51", "52", "53", "54", "55", "56", "57", "58", "59", "60", "61", "62", "63",
+  "64", "65", "66", "67", "68", "69", "70", "71", "72", "73", "74", "75", "76", "77", "78", "79",
+  "80", "81", "82", "83", "84", "85", "86", "87", "88", "89", "90", "91", "92", "93", "94", "95",
+  "96", "97", "98", "99", "100", "101", "102", "103", "104", "105", "106", "107", "108", "109", "110", "111",
+  "112", "113", "114", "115", "116", "117", "118", "119", "120", "121", "122", "123", "124", "125", "126", "127",
+  "128", "129", "130", "131", "132", "133", "134", "135", "136", "137", "138", "139", "140", "141", "142", "143",
+  "144", "145", "146", "147", "148", "149", "150", "151", "152", "153", "154", "155", "156", "157", "158", "159",
+  "160", "161", "162", "163", "164", "165", "166", "167", "168", "169", "170", "171", "172", "173", "174", "175",
+  "176", "177", "178", "179", "180", "181", "182", "183", "184", "185", "186", "187", "188", "189", "190", "191",
+  "192", "193", "194", "195", "196", "197", "198", "199", "200", "201", "202", "203", "204", "205", "206", "207",
+  "208", "209", "210", "211", "212", "213", "214", "215", "216", "217", "218", "219", "220", "221", "222", "223",
+  "224", "225", "226", "227", "228", "229", "230", "231", "232", "233", "234", "235", "236", "237", "238", "239",
+  "240", "241", "242", "243", "244", "245", "246", "247", "248", "249", "250", "251", "252", "253", "254", "255",
+};
+
+// writes num in decimal to buf, which must have room for one more byte
+static int convertnum(int num, char* buf) {
   int i, l = 0;
   int ch;
+
+  if ((unsigned)num < 256) {
+    memcpy(buf, digits[num], 4);
+    return 1 + (num >= 10) + (num >= 100);
+  }
+
   do {
     buf[l++] = '0' + (num % 10);
     num /= 10;
@@ -582,117 +1441,127 @@ static int convertnum(uint8_t num, char* buf) {
   return l;
 }
 
+// palette indexes, as the TB_ colors are rgb values with WITH_TRUECOLOR
+enum { BASE_BLACK = 16, BASE_RED = 1, BASE_GREEN, BASE_YELLOW, BASE_BLUE,
+       BASE_MAGENTA, BASE_LIGHT_GRAY = 7, BASE_MEDIUM_GRAY, BASE_WHITE = 15 };
+
 uint8_t map_to_base_color(tb_color col) {
   if (col > 255)
-    return TB_WHITE; // TB_DEFAULT;
+    return BASE_WHITE; // TB_DEFAULT;
   else if (col > 244) // light grays
-    return TB_LIGHT_GRAY;
+    return BASE_LIGHT_GRAY;
   else if (col > 231) // dark grays
-    return TB_MEDIUM_GRAY;
+    return BASE_MEDIUM_GRAY;
   else if (col == 16)
-    return TB_BLACK;
+    return BASE_BLACK;
   else if ((col - 16) % 36 == 0)
-    return TB_RED;
+    return BASE_RED;
   else if ((col - 16) % 6 == 0)
-    return TB_GREEN;
+    return BASE_GREEN;
   else if ((col - 16) % 3 == 0) // totally unscientific
-    return TB_YELLOW;
+    return BASE_YELLOW;
   else if (col % 3 == 0) // even less
-    return TB_MAGENTA;
+    return BASE_MAGENTA;
   else
-    return TB_BLUE;
+    return BASE_BLUE;
 }
 
-#define WRITE_LITERAL(X) bytebuffer_append(&output_buffer, (X), sizeof(X)-1)
-#define WRITE_INT(X) bytebuffer_append(&output_buffer, buf, convertnum((X), buf))
-
-static tb_color lastfg = LAST_ATTR_INIT, lastbg = LAST_ATTR_INIT;
-
-static void set_colors(tb_color fg, tb_color bg) {
-  if (fg == lastfg && bg == lastbg)
-    return;
-
-  lastfg = fg;
-  lastbg = bg;
+#define WRITE_LITERAL(X) bytebuffer_append(out, (X), sizeof(X)-1)
+#define WRITE_INT(X) bytebuffer_append(out, buf, convertnum((X), buf))
 
-  bytebuffer_puts(&output_buffer, funcs[T_SGR0]); // reset attrs
-
-  if (fg & TB_BOLD) {
-    bytebuffer_puts(&output_buffer, funcs[T_BOLD]);
-  }
+// attributes as tracked in renderstate.sgr_attrs
+#define SGR_BOLD      0x01
+#define SGR_UNDERLINE 0x02
+#define SGR_REVERSE   0x04
 
-  //if (bg & TB_BOLD)
-  //  bytebuffer_puts(&output_buffer, funcs[T_BLINK]);
+// parameters of a single SGR sequence, without the CSI and 'm'
+struct sgrparams {
+  char buf[64];
+  int len;
+};
 
-  if (fg & TB_UNDERLINE) {
-    bytebuffer_puts(&output_buffer, funcs[T_UNDERLINE]);
-  }
+/* Encoded sequences for recent color changes. Entries are keyed by the colors
+ * we're switching from and to, as what gets sent depends on both, and hold
+ * the state the terminal ends up in. Only used when the current state is
+ * known, so they never include the initial SGR0. Every thread that renders
+ * has its own. */
+#define SGR_CACHE_SIZE 256
+#define SGR_SEQ_MAX 48
+
+struct sgrcache {
+  tb_color fromfg, frombg, fg, bg;
+  int attrs, fgcol, bgcol;
+  uint8_t mode;
+  uint8_t len;
+  bool used;
+  char seq[SGR_SEQ_MAX];
+};
 
-  if ((fg & TB_REVERSE) || (bg & TB_REVERSE)) {
-    bytebuffer_puts(&output_buffer, funcs[T_REVERSE]);
-  }
+static __thread struct sgrcache sgr_cache[SGR_CACHE_SIZE];
 
-  tb_color fgcol, bgcol;
-  bool default_fg, default_bg;
+static struct sgrcache *sgr_cache_slot(tb_color fromfg, tb_color frombg, tb_color fg, tb_color bg) {
+  uint32_t h = fromfg * 0x9E3779B1u;
+  h = (h ^ frombg) * 0x9E3779B1u;
+  h = (h ^ fg) * 0x9E3779B1u;
+  h = (h ^ bg) * 0x9E3779B1u;
+  return &sgr_cache[(h >> 24) & (SGR_CACHE_SIZE - 1)];
+}
 
-#ifndef WITH_TRUECOLOR
-  // remove attributes
-  fgcol = fg & 0xFF;
-  bgcol = bg & 0xFF;
+static void sgr_param(struct sgrparams *p, int num) {
+  if (p->len) p->buf[p->len++] = ';';
+  p->len += convertnum(num, p->buf + p->len);
+}
 
-  default_fg = fgcol == TB_DEFAULT;
-  default_bg = bgcol == TB_DEFAULT;
+// forget what the terminal has, so the next set_colors() starts with a reset
+static void invalidate_colors(void) {
+  rstate->lastfg = rstate->lastbg = LAST_ATTR_INIT;
+  rstate->sgr_attrs = SGR_UNKNOWN;
+}
 
-  if (default_fg && default_bg)
-    return;
-#endif
+static void resolve_colors(tb_color fg, tb_color bg, int *attrs, int *fgcol, int *bgcol) {
+  *attrs = 0;
+  if (fg & TB_BOLD) *attrs |= SGR_BOLD;
+  if (fg & TB_UNDERLINE) *attrs |= SGR_UNDERLINE;
+  if ((fg & TB_REVERSE) || (bg & TB_REVERSE)) *attrs |= SGR_REVERSE;
 
-  char buf[32];
-  WRITE_LITERAL("\033[");
+  //if (bg & TB_BOLD)
+  //  blink
 
 #ifdef WITH_TRUECOLOR
 
-  default_fg = fg == TB_DEFAULT;
-  default_bg = bg == TB_DEFAULT;
-
   if (output_mode != 2) {
-
     // convert rgb value to either 256 or 16 color
-    fgcol = tb_rgb(fg);
-    bgcol = tb_rgb(bg);
-
+    *fgcol = fg == TB_DEFAULT ? SGR_DEFAULT : (int)tb_rgb(fg);
+    *bgcol = bg == TB_DEFAULT ? SGR_DEFAULT : (int)tb_rgb(bg);
   } else {
-
-    // write RGB color to buffer
-    WRITE_LITERAL("38;2;");
-    WRITE_INT(fg >> 16 & 0xFF); // fg R
-    WRITE_LITERAL(";");
-    WRITE_INT(fg >> 8 & 0xFF);  // fg G
-    WRITE_LITERAL(";");
-    WRITE_INT(fg & 0xFF);       // fg B
-    WRITE_LITERAL(";48;2;");
-    WRITE_INT(bg >> 16 & 0xFF); // bg R
-    WRITE_LITERAL(";");
-    WRITE_INT(bg >> 8 & 0xFF);  // bg G
-    WRITE_LITERAL(";");
-    WRITE_INT(bg & 0xFF);       // bg B
-
+    *fgcol = fg == TB_DEFAULT ? SGR_DEFAULT : (int)(fg & 0xFFFFFF);
+    *bgcol = bg == TB_DEFAULT ? SGR_DEFAULT : (int)(bg & 0xFFFFFF);
   }
 
 #else // no truecolor support
 
+  // remove attributes
+  *fgcol = (fg & 0xFF) == TB_DEFAULT ? SGR_DEFAULT : (int)(fg & 0xFF);
+  *bgcol = (bg & 0xFF) == TB_DEFAULT ? SGR_DEFAULT : (int)(bg & 0xFF);
+
   if (output_mode == 0) { // 16 colors
-    fgcol = fgcol > 16 ? map_to_base_color(fgcol) : fgcol; // & 0x0F;
-    bgcol = bgcol > 16 ? map_to_base_color(bgcol) : bgcol; // & 0x0F;
+    if (*fgcol > 16) *fgcol = map_to_base_color(*fgcol);
+    if (*bgcol > 16) *bgcol = map_to_base_color(*bgcol);
+    if (*fgcol == TB_BLACK) *fgcol = 0;
+    if (*bgcol == TB_BLACK) *bgcol = 0;
+
+    // the upper 8 foreground colors are the lower ones in bold
+    if (*fgcol > 7) *attrs |= SGR_BOLD;
   }
 
 #endif
+}
 
-  // 256 colors
-  // num      fg          bg
-  // 0-15     [38;5;(N)m  [48;5;(N)m -- 16 ANSI colors
-  // 16-231   [38;5;(N)m  [48;5;(N)m -- 6x6x6 RGB
-  // 232-255  [38;5;(N)m  [48;5;(N)m -- 24 grayscale
+// 256 colors
+// num      fg          bg
+// 0-15     [38;5;(N)m  [48;5;(N)m -- 16 ANSI colors
+// 16-231   [38;5;(N)m  [48;5;(N)m -- 6x6x6 RGB
+// 232-255  [38;5;(N)m  [48;5;(N)m -- 24 grayscale
 
 /*
   echo "256"
@@ -706,52 +1575,119 @@ static void set_colors(tb_color fg, tb_color bg) {
   echo -e "\e[1;33mbold\e[0mtext"
 */
 
-  if (output_mode == 1) {
+// 16 color ISO
+// num   fg         bg
+// 0-7   3(N)m      4(N)m
+// 8-15  1;3(N-8)m  1;4(N-8)m
 
-    if (!default_fg) {
-      WRITE_LITERAL("38;5;");
-      WRITE_INT(fgcol);
-      if (!default_bg) WRITE_LITERAL(";");
-    }
-    if (!default_bg) {
-      WRITE_LITERAL("48;5;");
-      WRITE_INT(bgcol);
-    }
+// in bold
+// 0-7   9(N)m      10(N)m
+// 8-15  1;9(N-8)m  1;9(N-8)m
+
+static void sgr_color(struct sgrparams *p, int col, bool is_bg) {
+  if (col == SGR_DEFAULT) {
+    sgr_param(p, is_bg ? 49 : 39);
+    return;
+  }
 
-  // 16 color ISO
-  // num   fg         bg
-  // 0-7   3(N)m      4(N)m
-  // 8-15  1;3(N-8)m  1;4(N-8)m
+  if (output_mode == 2) {
+    sgr_param(p, is_bg ? 48 : 38);
+    sgr_param(p, 2);
+    sgr_param(p, col >> 16 & 0xFF); // R
+    sgr_param(p, col >> 8 & 0xFF);  // G
+    sgr_param(p, col & 0xFF);       // B
+  } else if (output_mode == 1) {
+    sgr_param(p, is_bg ? 48 : 38);
+    sgr_param(p, 5);
+    sgr_param(p, col);
+  } else if (is_bg) {
+    sgr_param(p, col > 7 ? 100 + col - 8 : 40 + col);
+  } else {
+    sgr_param(p, 30 + (col > 7 ? col - 8 : col)); // bold was set apart
+  }
+}
 
-  // in bold
-  // 0-7   9(N)m      10(N)m
-  // 8-15  1;9(N-8)m  1;9(N-8)m
+static void set_colors(tb_color fg, tb_color bg) {
+  struct sgrparams delta, reset;
+  struct sgrcache tmp, *entry = &tmp;
+  int attrs, fgcol, bgcol, off, on;
 
-  } else if (output_mode == 0) {
+  if (fg == rstate->lastfg && bg == rstate->lastbg)
+    return;
 
-    if (!default_fg) {
-      if (fgcol > 7) { // upper 8
-        WRITE_LITERAL("1;3");
-        WRITE_INT(fgcol - 8);
-      } else {
-        WRITE_LITERAL("3");
-        WRITE_INT(fgcol);
-      }
-      if (!default_bg) WRITE_LITERAL(";");
+  if (rstate->sgr_attrs == SGR_UNKNOWN) {
+    bytebuffer_puts(out, funcs[T_SGR0]); // reset attrs
+    STAT(rstate->counts.sgr_sequences++);
+    rstate->sgr_attrs = 0;
+    rstate->sgr_fg = rstate->sgr_bg = SGR_DEFAULT;
+  } else {
+    entry = sgr_cache_slot(rstate->lastfg, rstate->lastbg, fg, bg);
+    if (entry->used && entry->mode == output_mode
+        && entry->fromfg == rstate->lastfg && entry->frombg == rstate->lastbg
+        && entry->fg == fg && entry->bg == bg) {
+      bytebuffer_append(out, entry->seq, entry->len);
+      STAT(rstate->counts.sgr_sequences += entry->len > 0);
+      rstate->sgr_attrs = entry->attrs;
+      rstate->sgr_fg = entry->fgcol;
+      rstate->sgr_bg = entry->bgcol;
+      rstate->lastfg = fg;
+      rstate->lastbg = bg;
+      return;
     }
+  }
 
-    if (!default_bg) {
-      if (bgcol > 7) { // upper 8
-        WRITE_LITERAL("10"); // "1;4"
-        WRITE_INT(bgcol - 8);
-      } else {
-        WRITE_LITERAL("4");
-        WRITE_INT(bgcol);
-      }
-    }
+  resolve_colors(fg, bg, &attrs, &fgcol, &bgcol);
+
+  off = rstate->sgr_attrs & ~attrs;
+  on = attrs & ~rstate->sgr_attrs;
+
+  delta.len = 0;
+  if (off & SGR_BOLD) sgr_param(&delta, 22);
+  if (off & SGR_UNDERLINE) sgr_param(&delta, 24);
+  if (off & SGR_REVERSE) sgr_param(&delta, 27);
+  if (on & SGR_BOLD) sgr_param(&delta, 1);
+  if (on & SGR_UNDERLINE) sgr_param(&delta, 4);
+  if (on & SGR_REVERSE) sgr_param(&delta, 7);
+  if (fgcol != rstate->sgr_fg) sgr_color(&delta, fgcol, false);
+  if (bgcol != rstate->sgr_bg) sgr_color(&delta, bgcol, true);
+
+  // turning several things off can take more than starting over
+  if (off) {
+    reset.len = 0;
+    sgr_param(&reset, 0);
+    if (attrs & SGR_BOLD) sgr_param(&reset, 1);
+    if (attrs & SGR_UNDERLINE) sgr_param(&reset, 4);
+    if (attrs & SGR_REVERSE) sgr_param(&reset, 7);
+    if (fgcol != SGR_DEFAULT) sgr_color(&reset, fgcol, false);
+    if (bgcol != SGR_DEFAULT) sgr_color(&reset, bgcol, true);
+    if (reset.len < delta.len) delta = reset;
+  }
+
+  entry->len = 0;
+  if (delta.len) {
+    memcpy(entry->seq, "\033[", 2);
+    memcpy(entry->seq + 2, delta.buf, delta.len);
+    entry->seq[2 + delta.len] = 'm';
+    entry->len = 3 + delta.len;
   }
 
-  WRITE_LITERAL("m");
+  entry->fromfg = rstate->lastfg;
+  entry->frombg = rstate->lastbg;
+  entry->fg = fg;
+  entry->bg = bg;
+  entry->attrs = attrs;
+  entry->fgcol = fgcol;
+  entry->bgcol = bgcol;
+  entry->mode = output_mode;
+  entry->used = true;
+
+  bytebuffer_append(out, entry->seq, entry->len);
+  STAT(rstate->counts.sgr_sequences += entry->len > 0);
+  rstate->sgr_attrs = attrs;
+  rstate->sgr_fg = fgcol;
+  rstate->sgr_bg = bgcol;
+  rstate->lastfg = fg;
+  rstate->lastbg = bg;
 }
 
 static void write_cursor(int x, int y) {
@@ -767,18 +1703,233 @@ static void write_title(const char * title) {
   tb_sendf("%c]0;%s%c\n", '\033', title, '\007');
 }
 
-static void send_char(int x, int y, uint32_t c) {
-  char buf[7];
-  int bw = tb_utf8_unicode_to_char(buf, c);
+static int num_len(int num) {
+  int l = 1;
+  while (num >= 10) {
+    num /= 10;
+    l++;
+  }
+  return l;
+}
+
+// CSI <n> <cmd>, leaving out n when it is 1
+static void write_csi(int n, char cmd) {
+  char buf[32];
+  WRITE_LITERAL("\033[");
+  if (n != 1) WRITE_INT(n);
+  bytebuffer_append(out, &cmd, 1);
+}
+
+static int csi_len(int n) {
+  return n == 1 ? 3 : 3 + num_len(n);
+}
 
-  if (x-1 != lastx || y != lasty) {
+/* Returns how many bytes it takes to re-send the cells of row y from column
+ * 'from' up to 'to' (exclusive) as they are on screen, or -1 if that can't be
+ * done with the current colors or costs more than 'limit'. Only plain ASCII is
+ * considered, so each cell is one byte and one column. */
+static int resend_cost(int from, int to, int y, int limit) {
+  int x;
+  cell_t *cell;
+
+  if (to - from > limit)
+    return -1;
+
+  for (x = from; x < to; ++x) {
+    cell = &CELL(&front_buffer, x, y);
+    if (cell->ch < 0x20 || cell->ch > 0x7E)
+      return -1;
+    if (CELL_FG(cell) != rstate->lastfg || CELL_BG(cell) != rstate->lastbg)
+      return -1;
+  }
+
+  return to - from;
+}
+
+enum { MOVE_NONE, MOVE_CR, MOVE_LF, MOVE_CHA, MOVE_CUF, MOVE_CUB,
+       MOVE_RESEND, MOVE_CUD, MOVE_CUU, MOVE_VPA };
+
+/* Moves the cursor to x/y with the shortest sequence we can find. Starting
+ * from where the last char left it, a vertical move (LF, CUD/CUU or VPA) is
+ * combined with a horizontal one (CR, CUF/CUB, CHA or re-sending the cells in
+ * between), and the pair is used if it beats an absolute CUP. LF is only used
+ * to land on column 0, so it does the right thing with or without newline
+ * mode. */
+static void move_cursor(int x, int y) {
+  int cup = 4 + num_len(y + 1) + num_len(x + 1);
+  int vmove = MOVE_NONE, hmove = MOVE_NONE;
+  int vcost = 0, hcost = 0, cost, dy, dx, i;
+
+  STAT(rstate->counts.cursor_moves++);
+
+  if (rstate->lastx == LAST_COORD_INIT || rstate->lasty == LAST_COORD_INIT) {
     write_cursor(x, y);
+    return;
   }
 
-  lastx = x; lasty = y;
+  dy = y - rstate->lasty;
+  dx = x - rstate->lastx;
+
+  if (dy == 1 && x == 0) {
+    vmove = MOVE_LF; vcost = 1;
+  } else if (dy != 0) {
+    vmove = dy > 0 ? MOVE_CUD : MOVE_CUU;
+    vcost = csi_len(dy > 0 ? dy : -dy);
+    if (3 + num_len(y + 1) < vcost) {
+      vmove = MOVE_VPA; vcost = 3 + num_len(y + 1);
+    }
+  }
+
+  if (dx != 0) {
+    if (x == 0) {
+      hmove = MOVE_CR; hcost = 1;
+    } else {
+      hmove = dx > 0 ? MOVE_CUF : MOVE_CUB;
+      hcost = csi_len(dx > 0 ? dx : -dx);
+      if (3 + num_len(x + 1) < hcost) {
+        hmove = MOVE_CHA; hcost = 3 + num_len(x + 1);
+      }
+      if (dy == 0 && dx > 0) {
+        cost = resend_cost(rstate->lastx, x, y, hcost - 1);
+        if (cost >= 0) {
+          hmove = MOVE_RESEND; hcost = cost;
+        }
+      }
+    }
+  }
+
+  cost = vcost + hcost;
+  if (cost >= cup) {
+    write_cursor(x, y);
+    return;
+  }
+
+  rstate->cursor_bytes_saved += cup - cost;
+
+  switch (vmove) {
+    case MOVE_LF:  bytebuffer_append(out, "\n", 1); break;
+    case MOVE_CUD: write_csi(dy, 'B'); break;
+    case MOVE_CUU: write_csi(-dy, 'A'); break;
+    case MOVE_VPA: write_csi(y + 1, 'd'); break;
+  }
+
+  switch (hmove) {
+    case MOVE_CR:  bytebuffer_append(out, "\r", 1); break;
+    case MOVE_CUF: write_csi(dx, 'C'); break;
+    case MOVE_CUB: write_csi(-dx, 'D'); break;
+    case MOVE_CHA: write_csi(x + 1, 'G'); break;
+    case MOVE_RESEND:
+      for (i = rstate->lastx; i < x; ++i) {
+        char ch = (char)CELL(&front_buffer, i, y).ch;
+        bytebuffer_append(out, &ch, 1);
+      }
+      break;
+  }
+}
+
+#ifdef WITH_TRUECOLOR
+#define IS_DEFAULT_BG(bg) ((bg) == TB_DEFAULT)
+#else
+#define IS_DEFAULT_BG(bg) (((bg) & 0xFF) == TB_DEFAULT)
+#endif
+
+// whether erasing gives the same result on screen as printing a blank cell
+static bool can_erase(const cell_t *cell) {
+  if (cell->ch != ' ')
+    return false;
+  if ((CELL_FG(cell) & (TB_UNDERLINE | TB_REVERSE)) || (CELL_BG(cell) & TB_REVERSE))
+    return false;
+  return (caps & CAP_BCE) || IS_DEFAULT_BG(CELL_BG(cell));
+}
+
+/* Looks for a run of cells identical to the one at x/y, which must already be
+ * set up with set_colors(). If the terminal can clear (EL, ECH) or repeat
+ * (REP) them for fewer bytes than printing each one, sends the whole run,
+ * updates the front buffer and returns how many cells it covered. Returns 0
+ * when the cells are better sent one by one.
+ *
+ * Unchanged cells inside the run are counted in, but not the ones at its
+ * tail, since those don't need to be sent at all. */
+static int send_run(struct cellbuf *src, int x, int y) {
+  cell_t *back = &CELL(src, x, y);
+  int i, n, last = x, literal, bw;
+  char buf[7], op;
+
+  if (!(caps & (CAP_REP | CAP_ECH | CAP_EL)))
+    return 0;
+
+  // REP would only repeat the last code point of a cluster
+  if (back->ch < 0x20 || IS_CLUSTER(back->ch) || tb_unicode_char_width(back->ch) != 1)
+    return 0;
+
+  for (i = x + 1; i < front_buffer.width; ++i) {
+    if (memcmp(&CELL(src, i, y), back, sizeof(cell_t)) != 0)
+      break;
+    if (memcmp(&CELL(&front_buffer, i, y), back, sizeof(cell_t)) != 0)
+      last = i;
+  }
+
+  n = last - x + 1;
+  bw = tb_utf8_unicode_to_char(buf, back->ch);
+  literal = n * bw;
+
+  if ((caps & CAP_EL) && i == front_buffer.width && can_erase(back) && 3 < literal) {
+    op = 'K'; n = i - x; // blanks all the way to the end of the row
+  } else if ((caps & CAP_ECH) && can_erase(back) && 2 * csi_len(n) < literal) {
+    op = 'X'; // ECH leaves the cursor in place, so count moving past the run too
+  } else if ((caps & CAP_REP) && n > 1 && bw + csi_len(n - 1) < literal) {
+    op = 'b';
+  } else {
+    return 0;
+  }
+
+  if (x != rstate->lastx || y != rstate->lasty) {
+    move_cursor(x, y);
+  }
+
+  if (op == 'b') {
+    bytebuffer_append(out, buf, bw);
+    write_csi(n - 1, 'b');
+    rstate->lastx = x + n < front_buffer.width ? x + n : LAST_COORD_INIT;
+  } else {
+    if (op == 'K') WRITE_LITERAL("\033[K");
+    else write_csi(n, 'X');
+    rstate->lastx = x;
+  }
+
+  rstate->lasty = y;
+  for (i = 1; i < n; ++i)
+    CELL(&front_buffer, x + i, y) = *back;
+
+  return n;
+}
+
+// w is the number of columns the char takes on screen
+static void send_char(int x, int y, uint32_t c, int w) {
+  char buf[7];
+  const char *str = buf;
+  int bw;
+
+  if (IS_CLUSTER(c) && CLUSTER_HELD(c)) {
+    str = CLUSTER(c)->str;
+    bw = CLUSTER(c)->len;
+  } else if (IS_CLUSTER(c)) {
+    bw = tb_utf8_unicode_to_char(buf, 0xFFFD); // not a cluster we know of
+  } else {
+    bw = tb_utf8_unicode_to_char(buf, c);
+  }
+
+  if (x != rstate->lastx || y != rstate->lasty) {
+    move_cursor(x, y);
+  }
+
+  // once the last column is written the terminal may or may not wrap on the
+  // next char, so we stop guessing where the cursor is
+  rstate->lastx = x + w < front_buffer.width ? x + w : LAST_COORD_INIT;
+  rstate->lasty = y;
   if (!c) buf[0] = ' '; // replace 0 with whitespace
 
-  bytebuffer_append(&output_buffer, buf, bw);
+  bytebuffer_append(out, str, bw);
 }
 
 static void sigwinch_handler(int xxx) {
@@ -840,13 +1991,16 @@ static int decode_esc(struct tb_event * event) {
 
   while (nread < MAXSEQ) {
     rs = read(inout, seq + nread++, 1);
-    if (rs == -1) return -1;
-    if (rs == 0) break;
+    if (rs == -1 && errno != EAGAIN) return -1;
+    if (rs < 1) break;
 
     // handle urxvt alt + keys
     if (seq[nread-1] == 27) { // found another escape char!
       if (seq[nread-2] == 27) { // double esc
-        if (read(inout, seq + nread++, 1) == 0) { // end of the road, so it's alt+esc
+        // end of the road, so it's alt+esc. on a non-blocking fd (see
+        // tb_set_nonblocking_output) that's EAGAIN rather than 0
+        rs = read(inout, seq + nread++, 1);
+        if (rs == 0 || (rs < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))) {
           event->key  = TB_KEY_ESC;
           event->meta = TB_META_ALT;
           return 1;
@@ -869,7 +2023,8 @@ static int decode_esc(struct tb_event * event) {
 }
 
 static int read_and_extract_event(struct tb_event * event) {
-  int nread, c = 0;
+  int nread, n, c = 0;
+  uint64_t start;
 
   if (cutesc) {
     c = 27;
@@ -883,15 +2038,19 @@ static int read_and_extract_event(struct tb_event * event) {
   event->meta = 0;
   event->ch   = 0;
 
+  start = trace_begin();
   if (c == 27) { // escape
-    return decode_esc(event);
+    n = decode_esc(event);
 
   } else if (0 <= c && c <= 127) { // from ctrl-a to z, not esc
-    return decode_char(event, c);
+    n = decode_char(event, c);
 
   } else { // utf8 sequence
-    return decode_utf8(event, c);
+    n = decode_utf8(event, c);
   }
+  trace_end("decode_input", start);
+
+  return n;
 }
 
 static int wait_fill_event(struct tb_event *event, struct timeval *timeout) {
@@ -907,7 +2066,8 @@ static int wait_fill_event(struct tb_event *event, struct timeval *timeout) {
 
   while (1) {
     FD_ZERO(&events);
-    FD_SET(inout, &events);
+    if (!headless)
+      FD_SET(inout, &events);
     FD_SET(winch_fds[0], &events);
     int maxfd  = (winch_fds[0] > inout) ? winch_fds[0] : inout;
     int result = select(maxfd+1, &events, 0, 0, timeout);
@@ -925,7 +2085,7 @@ static int wait_fill_event(struct tb_event *event, struct timeval *timeout) {
       return TB_EVENT_RESIZE;
     }
 
-    if (FD_ISSET(inout, &events)) {
+    if (!headless && FD_ISSET(inout, &events)) {
       n = read_and_extract_event(event) > 0;
       if (n < 0) return -1;
       if (n > 0) return event->type;
@@ -106,7 +106,7 @@ typedef uint16_t tb_color;
 
 /* A cell, single conceptual entity on the terminal screen. The terminal screen
  * is basically a 2d array of cells. It has the following fields:
- *  - 'ch' is a unicode character
+ *  - 'ch' is a unicode character, or a grapheme cluster (see tb_cluster())
  *  - 'fg' foreground color and attributes
  *  - 'bg' background color and attributes
  */
@@ -119,6 +119,21 @@ struct tb_cell {
 	tb_color bg;
 };
 
+/* Chars made of several code points (emoji sequences, flags, letters with
+ * combining marks) are kept by termbox, and cells hold a TB_CLUSTER value
+ * standing for them. tb_string() and friends do this by themselves.
+ *
+ * tb_cluster() returns the char for the first grapheme cluster of str: the
+ * code point itself if it's just one, or a TB_CLUSTER value. tb_cluster_str()
+ * returns the (NUL-terminated) UTF-8 of a TB_CLUSTER value and its length, or
+ * NULL for other chars. A TB_CLUSTER value stays good while a cell of the back
+ * buffer holds it; the ones no longer in use are recycled when room runs out.
+ */
+#define TB_CLUSTER 0x80000000
+
+SO_IMPORT tb_chr tb_cluster(const char *str);
+SO_IMPORT const char *tb_cluster_str(tb_chr ch, int *len);
+
 #define TB_EVENT_KEY    1
 #define TB_EVENT_RESIZE 2
 #define TB_EVENT_MOUSE  3
@@ -152,17 +167,25 @@ struct tb_event {
 #define TB_EPIPE_TRAP_ERROR      -3
 
 /* Flags passed to tb_init_with() to specify which features should be enabled.
+ * TB_INIT_SYNC_OUTPUT is opt-in: TB_INIT_ALL (what tb_init() uses) leaves it
+ * out, so it has to be or-ed in.
  */
-#define TB_INIT_ALL          -1
+#define TB_INIT_ALL          (-1 & ~TB_INIT_SYNC_OUTPUT)
 #define TB_INIT_ALTSCREEN     1
 #define TB_INIT_KEYPAD        2
 #define TB_INIT_NO_CURSOR     3
 #define TB_INIT_DETECT_MODE   4
+#define TB_INIT_SYNC_OUTPUT   8 /* wrap each frame in begin/end synchronized update */
 
 /* Initializes the termbox library. This function should be called before any
  * other functions. Function tb_init is same as tb_init_file("/dev/tty").
  * After successful initialization, the library must be
  * finalized using the tb_shutdown() function.
+ *
+ * For timelines, set TB_TRACE to a file path before tb_init(): tb_shutdown()
+ * writes what rendering, output, input and resizes took there, in Chrome's
+ * trace event format (for Perfetto or chrome://tracing). Only the latest 64K
+ * events are kept.
  */
 SO_IMPORT int tb_init(void);
 SO_IMPORT int tb_init_screen(int flags);
@@ -171,6 +194,21 @@ SO_IMPORT int tb_init_file(const char* name);
 SO_IMPORT int tb_init_fd(int inout);
 SO_IMPORT void tb_shutdown(void);
 
+/* Initializes termbox without a terminal, for tests and benchmarks. The size
+ * is fixed at width x height, no events other than timeouts ever come, and
+ * the escape sequences are those of TERM, or xterm's if it's unknown.
+ *
+ * Everything termbox writes is passed to sink, in order (from the render
+ * thread, if there's one). With no sink, it is kept in memory instead:
+ * tb_headless_output() returns what has piled up so far, and
+ * tb_headless_clear_output() throws it away.
+ */
+typedef void (*tb_output_sink)(const char *data, int len, void *user_data);
+
+SO_IMPORT int tb_init_headless(int width, int height, int flags, tb_output_sink sink, void *user_data);
+SO_IMPORT const char *tb_headless_output(int *len);
+SO_IMPORT void tb_headless_clear_output(void);
+
 /* Returns the size of the internal back buffer (which is the same as
  * terminal's window size in characters). The internal buffer can be resized
  * after tb_resize() or tb_present() function calls. Both dimensions have an
@@ -192,6 +230,79 @@ SO_IMPORT void tb_clear_screen(void);
 /* Sincronize the internal back buffer with the terminal. */
 SO_IMPORT void tb_render(void);
 
+/* Moves writing to the terminal to a separate thread. tb_render() then only
+ * copies the back buffer and returns, and the thread diffs it and writes it out
+ * when the terminal is ready. If it falls behind, frames in between are
+ * dropped and only the latest one is written. Calls that write to the terminal
+ * directly (tb_flush(), tb_clear_screen(), tb_resize(), ...) wait for it to
+ * finish first. Returns -1 if the thread could not be started. */
+SO_IMPORT int tb_enable_render_thread(void);
+SO_IMPORT void tb_disable_render_thread(void);
+
+/* Renders frames with many changes on n threads, the caller included, each
+ * taking a band of rows. 1 goes back to rendering on a single thread. Returns
+ * -1 if the threads could not be started, leaving it at one. */
+SO_IMPORT int tb_set_render_threads(int n);
+
+/* Stops tb_render(), tb_flush() and tb_clear_screen() from blocking when the
+ * terminal can't keep up: whatever it doesn't take right away stays queued
+ * and goes out, ahead of anything new, on the next call. tb_pending_output()
+ * tells how much is waiting (the render thread's backlog included), so the
+ * app can hold off producing frames.
+ * Puts the tty in O_NONBLOCK mode, until disabled or tb_shutdown(). Returns
+ * -1 if that fails. */
+SO_IMPORT int tb_set_nonblocking_output(int enable);
+SO_IMPORT int tb_pending_output(void);
+
+/* Sets how big the output buffer can get (256K by default) before it's
+ * written out, halfway through a frame if need be, waiting on the terminal
+ * even with non-blocking output. 0 means no limit. The buffer shrinks back to
+ * its starting size once output has been small for a while. */
+SO_IMPORT void tb_set_output_limit(int bytes);
+
+/* Returns how many bytes the last tb_render() saved by moving the cursor with
+ * relative or single-axis sequences instead of absolute positioning. */
+SO_IMPORT int tb_cursor_bytes_saved(void);
+
+/* What rendering has cost, frame by frame. 'last' is the latest frame written
+ * out, along with any output (tb_flush(), tb_clear_screen(), ...) since the
+ * one before; 'total' adds up every frame since tb_init(). Times are in
+ * nanoseconds: render_ns is diffing and encoding, flush_ns writing out. */
+struct tb_frame_stats {
+  uint64_t cells_scanned; // compared against the front buffer
+  uint64_t cells_changed; // sent to the terminal
+  uint64_t bytes;
+  uint64_t cursor_moves;
+  uint64_t sgr_sequences;
+  uint64_t writes;        // write calls, or sink calls when headless
+  uint64_t flush_ns;
+  uint64_t render_ns;
+};
+
+struct tb_stats {
+  struct tb_frame_stats last;
+  struct tb_frame_stats total;
+  uint64_t frames;
+  uint64_t resizes;
+};
+
+/* Copies the statistics so far into stats. Returns -1, with stats zeroed, if
+ * termbox was built without them (WITH_STATS off). */
+SO_IMPORT int tb_get_stats(struct tb_stats *stats);
+
+/* Shows an overlay with the frame rate, the render time and bytes per frame
+ * (min, avg and p99 over the last 120 frames) and the output queued ahead of
+ * the frame, in one corner. It's drawn over what tb_render() sends, so the
+ * back buffer doesn't change. TB_HUD=1..4 in the environment turns it on at
+ * tb_init(). */
+#define TB_HUD_OFF          0
+#define TB_HUD_TOP_LEFT     1
+#define TB_HUD_TOP_RIGHT    2
+#define TB_HUD_BOTTOM_LEFT  3
+#define TB_HUD_BOTTOM_RIGHT 4
+
+SO_IMPORT void tb_show_hud(int corner);
+
 SO_IMPORT tb_color tb_rgb(uint32_t in);
 
 /* Sets the position of the cursor. Upper-left character is (0, 0). If you pass
@@ -207,7 +318,9 @@ SO_IMPORT void tb_set_title(const char * title);
 // Flush output buffer to file descriptor (stdout).
 SO_IMPORT void tb_flush(void);
 
-/* Append string directly to output */
+/* Append string directly to output. Big strings (16K and up, like image data)
+ * are not copied: they're written right away, together with anything queued
+ * before them. */
 SO_IMPORT void tb_send(const char * str);
 
 /* Same as above but with format and arguments (printf-style) */
@@ -232,13 +345,61 @@ SO_IMPORT void tb_empty(int x, int y, tb_color bg, int width);
  */
 SO_IMPORT void tb_cell(int x, int y, const struct tb_cell *cell);
 
+/* Sets every cell of a w x h region starting at x/y to a copy of cell. The
+ * region is clipped to the back buffer. */
+SO_IMPORT void tb_fill_rect(int x, int y, int w, int h, const struct tb_cell *cell);
+
+/* Copies a w x h block of cells to x/y, where src points to its top left
+ * cell and src_stride is the number of cells from one of its rows to the
+ * next. Whatever falls outside the back buffer is left out. Cheaper than
+ * calling tb_cell() for each one, and unlike writing to tb_cell_buffer(), no
+ * tb_mark_dirty() call is needed. */
+SO_IMPORT void tb_blit(int x, int y, int w, int h, const struct tb_cell *src, int src_stride);
+
 /* Returns a pointer to internal cell back buffer. You can get its dimensions
  * using tb_width() and tb_height() functions. The pointer stays valid as long
  * as no tb_resize() and tb_present() calls are made. The buffer is
  * one-dimensional buffer containing lines of cells starting from the top.
+ *
+ * Calling this marks the whole buffer as changed for the next tb_render(). If
+ * you keep the pointer around and write through it later, tell termbox which
+ * cells you touched with tb_mark_dirty().
+ *
+ * When built WITH_COMPACT_CELLS, this is a copy of the internal buffer, kept
+ * up to date by termbox and read back for the changed cells on tb_render().
  */
 SO_IMPORT struct tb_cell *tb_cell_buffer(void);
 
+/* Marks a w x h region starting at x/y as changed, so tb_render() compares it
+ * against what is on screen. Only needed after writing directly to the cell
+ * buffer; the other drawing functions keep track of this by themselves.
+ */
+SO_IMPORT void tb_mark_dirty(int x, int y, int w, int h);
+
+/* Layers are cell buffers of their own, stacked over the back buffer at an
+ * offset, in z order (the highest on top; ties go to the one created last).
+ * tb_render() puts together what's showing and redraws just the parts that
+ * changed, and doesn't look at what opaque layers cover.
+ *
+ * Cells of a layer start out as TB_TRANSPARENT, which shows whatever is under
+ * them, or as blanks for TB_LAYER_OPAQUE layers. tb_layer_create() returns
+ * the new layer's id, or -1 if there are too many (32) or the size is empty.
+ *
+ * After tb_select_layer(), tb_char(), tb_string(), tb_cell(), tb_empty(),
+ * tb_fill_rect(), tb_blit() and tb_clear_buffer() draw to that layer, in its
+ * own coordinates. Selecting 0 goes back to the back buffer, which is also what
+ * tb_cell_buffer() and tb_mark_dirty() always work on.
+ */
+#define TB_TRANSPARENT 0x7FFFFFFF
+#define TB_LAYER_OPAQUE 1
+
+SO_IMPORT int tb_layer_create(int x, int y, int w, int h, int z, int flags);
+SO_IMPORT void tb_layer_destroy(int layer);
+SO_IMPORT void tb_layer_move(int layer, int x, int y);
+SO_IMPORT void tb_layer_set_z(int layer, int z);
+SO_IMPORT void tb_layer_show(int layer, int show);
+SO_IMPORT int tb_select_layer(int layer);
+
 SO_IMPORT void tb_hide_cursor(void);
 SO_IMPORT void tb_show_cursor(void);
 
@@ -305,6 +466,27 @@ SO_IMPORT int tb_utf8_char_to_unicode(uint32_t *out, const char *c);
 SO_IMPORT int tb_utf8_unicode_to_char(char *out, uint32_t c);
 SO_IMPORT int tb_unicode_is_char_wide(uint32_t c);
 
+/* Returns the length in bytes of the grapheme cluster (what shows as a single
+ * char, like an emoji with a skin tone, a flag or a letter with combining
+ * marks) str starts with, or 0 at the end of the string. If width isn't NULL,
+ * the columns the cluster takes are stored there. Segmenting follows the
+ * common cases of UAX #29, not every rule of it. */
+SO_IMPORT int tb_utf8_grapheme_length(const char *str, int *width);
+
+/* Returns the number of columns a codepoint takes on screen: 0 for combining
+ * marks and controls, 2 for wide chars and 1 for everything else. Widths come
+ * from a table generated from the Unicode data (see tools/gen_unicode_width.py)
+ * and don't depend on the locale.
+ *
+ * Terminals don't always agree with the table, so tb_set_char_width() lets you
+ * override the width of the first..last range (inclusive). Later overrides win
+ * over earlier ones. Returns -1 if the width is not 0-2 or too many ranges
+ * were set. Change widths before drawing, or call tb_resize() afterwards to
+ * repaint everything. */
+SO_IMPORT int tb_unicode_char_width(uint32_t c);
+SO_IMPORT int tb_set_char_width(uint32_t first, uint32_t last, int width);
+SO_IMPORT void tb_reset_char_widths(void);
+
 /* Key constants. See also struct tb_event's key field.
  *
  * These are a safe subset of terminfo keys, which exist on all popular
@@ -0,0 +1,105 @@
+// Timelines. With TB_TRACE=/path in the environment, tb_init() starts keeping
+// a ring of timed events (renders, flushes, waits for input, decoding it,
+// resizes) and tb_shutdown() writes them to /path in Chrome's trace event
+// format, which Perfetto and chrome://tracing open. Once the ring is full the
+// oldest events make room for new ones.
+//
+// Any thread can add events: each claims a slot with an atomic increment and
+// fills it in, without locks. Events are only read at tb_shutdown(), after the
+// writer and band threads are gone. With TB_TRACE unset, tracing costs a
+// branch per event.
+
+#include <stdio.h>
+#include <unistd.h>
+
+#define TRACE_EVENTS (64 * 1024) // a power of two
+
+struct traceevent {
+  const char *name;
+  uint64_t start; // ns
+  uint64_t dur;
+  unsigned tid;
+};
+
+static struct traceevent *trace_ring; // NULL when not tracing
+static char *trace_path;
+static uint64_t trace_epoch;
+static unsigned trace_next;    // slots claimed so far
+static unsigned trace_threads; // ids handed out so far
+static __thread unsigned trace_tid;
+
+// returns the time an event starts at, or 0 when not tracing
+static uint64_t trace_begin(void) {
+  return trace_ring ? clock_ns() : 0;
+}
+
+// adds an event from 'start' (from trace_begin) until now
+static void trace_end(const char *name, uint64_t start) {
+  struct traceevent *ev;
+  uint64_t now;
+
+  if (!trace_ring || !start)
+    return;
+
+  now = clock_ns();
+  if (!trace_tid)
+    trace_tid = __atomic_add_fetch(&trace_threads, 1, __ATOMIC_RELAXED);
+
+  ev = &trace_ring[__atomic_fetch_add(&trace_next, 1, __ATOMIC_RELAXED) & (TRACE_EVENTS - 1)];
+  ev->name = name;
+  ev->start = start;
+  ev->dur = now - start;
+  ev->tid = trace_tid;
+}
+
+static void trace_start(void) {
+  const char *path = getenv("TB_TRACE");
+
+  if (!path || !*path || trace_ring)
+    return;
+
+  trace_ring = (struct traceevent*)calloc(TRACE_EVENTS, sizeof(struct traceevent));
+  trace_path = strdup(path);
+  if (!trace_ring || !trace_path) {
+    free(trace_ring);
+    free(trace_path);
+    trace_ring = NULL;
+    trace_path = NULL;
+    return;
+  }
+
+  trace_next = 0;
+  trace_epoch = clock_ns();
+}
+
+// writes out the ring, oldest event first, and stops tracing
+static void trace_dump(void) {
+  unsigned i, first, last;
+  struct traceevent *ev;
+  FILE *f;
+  int pid = getpid();
+
+  if (!trace_ring)
+    return;
+
+  last = __atomic_load_n(&trace_next, __ATOMIC_ACQUIRE);
+  first = last > TRACE_EVENTS ? last - TRACE_EVENTS : 0;
+
+  f = fopen(trace_path, "w");
+  if (f) {
+    fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", f);
+    for (i = first; i != last; ++i) {
+      ev = &trace_ring[i & (TRACE_EVENTS - 1)];
+      fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%u}",
+        i == first ? "" : ",", ev->name, (ev->start - trace_epoch) / 1000.0, ev->dur / 1000.0,
+        pid, ev->tid);
+    }
+    fputs("\n]}\n", f);
+    fclose(f);
+  }
+
+  free(trace_ring);
+  free(trace_path);
+  trace_ring = NULL;
+  trace_path = NULL;
+}
@@ -1,4 +1,5 @@
 #include "termbox.h"
+#include "unicode_width.inl"
 
 static const unsigned char utf8_length[256] = {
   1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
@@ -77,17 +78,146 @@ int tb_utf8_unicode_to_char(char *out, uint32_t c) {
   return len;
 }
 
+// ranges set with tb_set_char_width(), the newest one wins
+#define MAX_WIDTH_OVERRIDES 32
+
+static struct {
+  uint32_t first;
+  uint32_t last;
+  int width;
+} width_overrides[MAX_WIDTH_OVERRIDES];
+
+static int num_width_overrides = 0;
+
+int tb_unicode_char_width(uint32_t cp) {
+  int i;
+
+  for (i = num_width_overrides - 1; i >= 0; --i) {
+    if (width_overrides[i].first <= cp && cp <= width_overrides[i].last)
+      return width_overrides[i].width;
+  }
+
+  if (cp >= 0x110000)
+    return 1;
+
+  return (width_stage2[width_stage1[cp >> 8]][(cp & 0xFF) >> 2] >> ((cp & 3) * 2)) & 3;
+}
+
 int tb_unicode_is_char_wide(uint32_t cp) {
-  int res = 0;
-
-  if (0x1D000 <= cp && cp <= 0x1F77F) // emoticons
-    res = 1;
-  else if (0x2100 <= cp && cp <= 0x27BF) // misc symbols and dingbats
-    res = 1;
-  // else if (0xFE00 <= cp && cp <= 0xFE0F) // Variation Selectors
-  //   res = 1;
-  else if (0x1F900 <= cp && cp <= 0x1F9FF) // Supplemental Symbols and Pictographs
-    res = 1;
-
-  return res;
+  return tb_unicode_char_width(cp) == 2;
+}
+
+int tb_set_char_width(uint32_t first, uint32_t last, int width) {
+  if (width < 0 || width > 2 || first > last)
+    return -1;
+
+  if (num_width_overrides == MAX_WIDTH_OVERRIDES)
+    return -1;
+
+  width_overrides[num_width_overrides].first = first;
+  width_overrides[num_width_overrides].last = last;
+  width_overrides[num_width_overrides].width = width;
+  num_width_overrides++;
+  return 0;
+}
+
+void tb_reset_char_widths(void) {
+  num_width_overrides = 0;
+}
+
+// a loose take on the Extend class of UAX #29: code points that attach to the
+// one before them, like combining marks, variation selectors and skin tones
+static int is_extend(uint32_t cp) {
+  if (cp < 0x300)
+    return 0;
+  if (cp >= 0x2000 && cp <= 0x206F) // spaces and format chars, but ZWNJ/ZWJ
+    return cp == 0x200C || cp == 0x200D;
+  if (cp == 0xFEFF)
+    return 0;
+  if ((cp >= 0xFE00 && cp <= 0xFE0F) || (cp >= 0xE0100 && cp <= 0xE01EF))
+    return 1;
+  if ((cp >= 0x1F3FB && cp <= 0x1F3FF) || (cp >= 0xE0020 && cp <= 0xE007F))
+    return 1;
+  return tb_unicode_char_width(cp) == 0;
+}
+
+// Extended_Pictographic, from emoji-data.txt: what a ZWJ may join onto
+static const uint32_t pictographic[][2] = {
+  { 0x00A9, 0x00A9 }, { 0x00AE, 0x00AE }, { 0x203C, 0x203C }, { 0x2049, 0x2049 },
+  { 0x2122, 0x2122 }, { 0x2139, 0x2139 }, { 0x2194, 0x2199 }, { 0x21A9, 0x21AA },
+  { 0x231A, 0x231B }, { 0x2328, 0x2328 }, { 0x2388, 0x2388 }, { 0x23CF, 0x23CF },
+  { 0x23E9, 0x23F3 }, { 0x23F8, 0x23FA }, { 0x24C2, 0x24C2 }, { 0x25AA, 0x25AB },
+  { 0x25B6, 0x25B6 }, { 0x25C0, 0x25C0 }, { 0x25FB, 0x25FE }, { 0x2600, 0x2605 },
+  { 0x2607, 0x2612 }, { 0x2614, 0x2685 }, { 0x2690, 0x2705 }, { 0x2708, 0x2712 },
+  { 0x2714, 0x2714 }, { 0x2716, 0x2716 }, { 0x271D, 0x271D }, { 0x2721, 0x2721 },
+  { 0x2728, 0x2728 }, { 0x2733, 0x2734 }, { 0x2744, 0x2744 }, { 0x2747, 0x2747 },
+  { 0x274C, 0x274C }, { 0x274E, 0x274E }, { 0x2753, 0x2755 }, { 0x2757, 0x2757 },
+  { 0x2763, 0x2767 }, { 0x2795, 0x2797 }, { 0x27A1, 0x27A1 }, { 0x27B0, 0x27B0 },
+  { 0x27BF, 0x27BF }, { 0x2934, 0x2935 }, { 0x2B05, 0x2B07 }, { 0x2B1B, 0x2B1C },
+  { 0x2B50, 0x2B50 }, { 0x2B55, 0x2B55 }, { 0x3030, 0x3030 }, { 0x303D, 0x303D },
+  { 0x3297, 0x3297 }, { 0x3299, 0x3299 }, { 0x1F000, 0x1F0FF }, { 0x1F10D, 0x1F10F },
+  { 0x1F12F, 0x1F12F }, { 0x1F16C, 0x1F171 }, { 0x1F17E, 0x1F17F }, { 0x1F18E, 0x1F18E },
+  { 0x1F191, 0x1F19A }, { 0x1F1AD, 0x1F1E5 }, { 0x1F201, 0x1F20F }, { 0x1F21A, 0x1F21A },
+  { 0x1F22F, 0x1F22F }, { 0x1F232, 0x1F23A }, { 0x1F23C, 0x1F23F }, { 0x1F249, 0x1F3FA },
+  { 0x1F400, 0x1F53D }, { 0x1F546, 0x1F64F }, { 0x1F680, 0x1F6FF }, { 0x1F774, 0x1F77F },
+  { 0x1F7D5, 0x1F7FF }, { 0x1F80C, 0x1F80F }, { 0x1F848, 0x1F84F }, { 0x1F85A, 0x1F85F },
+  { 0x1F888, 0x1F88F }, { 0x1F8AE, 0x1F8FF }, { 0x1F90C, 0x1F93A }, { 0x1F93C, 0x1F945 },
+  { 0x1F947, 0x1FAFF }, { 0x1FC00, 0x1FFFD },
+};
+
+static int is_pictographic(uint32_t cp) {
+  int lo = 0, hi = sizeof(pictographic) / sizeof(pictographic[0]) - 1, mid;
+
+  if (cp < 0xA9)
+    return 0;
+
+  while (lo <= hi) {
+    mid = (lo + hi) / 2;
+    if (cp < pictographic[mid][0])
+      hi = mid - 1;
+    else if (cp > pictographic[mid][1])
+      lo = mid + 1;
+    else
+      return 1;
+  }
+  return 0;
+}
+
+static int is_regional_indicator(uint32_t cp) {
+  return cp >= 0x1F1E6 && cp <= 0x1F1FF;
+}
+
+int tb_utf8_grapheme_length(const char *str, int *width) {
+  uint32_t cp, next;
+  int len, n, w, pairs, pict;
+
+  if (*str == 0)
+    return 0;
+
+  len = tb_utf8_char_to_unicode(&cp, str);
+  w = tb_unicode_char_width(cp);
+  pairs = is_regional_indicator(cp); // a flag is two of them
+  pict = is_pictographic(cp);
+
+  while (cp >= 0x20 && str[len]) {
+    n = tb_utf8_char_to_unicode(&next, str + len);
+
+    if (cp == 0x200D && pict && is_pictographic(next)) {
+      // a ZWJ after an emoji joins the next one (GB11), but not other text
+    } else if (pairs && is_regional_indicator(next)) {
+      w = 2;
+    } else if (is_extend(next)) {
+      if (next == 0xFE0F) w = 2; // emoji presentation
+    } else {
+      break;
+    }
+
+    pairs = 0;
+    cp = next;
+    len += n;
+  }
+
+  if (width)
+    *width = w < 1 ? 1 : w;
+  return len;
 }
@@ -0,0 +1,192 @@
+// Optional writer thread. tb_render() copies the back buffer into a frame and
+// hands it over; the thread diffs it against the front buffer and does the
+// (possibly slow) write() to the terminal, so the caller never blocks on it.
+//
+// Frames are passed through a lock-free triple buffer: the main thread fills
+// one, the writer renders another and the third sits in the middle slot. When
+// the writer falls behind, a new frame simply replaces the one in the middle,
+// so only the latest gets written. Bytes queued before the dropped frame (with
+// tb_send() and the like) are carried over into the next one.
+//
+// While the thread runs it owns the front buffer and all of the render state
+// (last cursor position, SGR state), so anything on the main thread that
+// touches those, or writes to the terminal directly, calls writer_drain()
+// first.
+
+#include <pthread.h>
+#include <semaphore.h>
+
+struct frame {
+  struct cellbuf buf;
+  struct bytebuffer prefix; // bytes queued before this frame
+  int cursor_x;
+  int cursor_y;
+  unsigned seq;
+};
+
+#define FRAME_FRESH 0x4 // set on the middle slot when it holds an unseen frame
+#define FRAME_INDEX(slot) ((slot) & 0x3)
+
+static struct frame frames[3];
+static struct bytebuffer writer_output;
+static int frame_middle;   // index of the middle frame, plus FRAME_FRESH
+static int frame_main;     // owned by the main thread
+static int frame_writer;   // owned by the writer thread
+
+static pthread_t writer_thread;
+static bool writer_running = false;
+static bool writer_stop = false;
+static sem_t writer_wakeup;
+
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_idle = PTHREAD_COND_INITIALIZER;
+static unsigned frames_published = 0;
+static unsigned frames_written = 0;
+static unsigned frames_dropped = 0;
+
+/* Bytes handed to the writer and not written out yet, for tb_pending_output():
+ * queued output carried by frames, and whatever the writer is writing. */
+static int writer_queued = 0;
+static int writer_counted = 0; // how much of writer_output is in writer_queued
+
+static void render_frame(struct frame *frame);
+
+static void writer_queue(int bytes) {
+  __atomic_add_fetch(&writer_queued, bytes, __ATOMIC_RELAXED);
+}
+
+// the writer is about to write out all of writer_output
+static void writer_sending(void) {
+  writer_queue(writer_output.len - writer_counted);
+  writer_counted = writer_output.len;
+}
+
+static void writer_sent(void) {
+  writer_queue(-writer_counted);
+  writer_counted = 0;
+}
+
+static void *writer_main(void *unused) {
+  (void)unused;
+  int slot;
+  struct frame *frame;
+
+  while (1) {
+    sem_wait(&writer_wakeup);
+    if (__atomic_load_n(&writer_stop, __ATOMIC_ACQUIRE))
+      break;
+
+    if (!(__atomic_load_n(&frame_middle, __ATOMIC_ACQUIRE) & FRAME_FRESH))
+      continue;
+
+    slot = __atomic_exchange_n(&frame_middle, frame_writer, __ATOMIC_ACQ_REL);
+    frame_writer = FRAME_INDEX(slot);
+    if (!(slot & FRAME_FRESH))
+      continue;
+
+    frame = &frames[frame_writer];
+    render_frame(frame);
+
+    pthread_mutex_lock(&writer_lock);
+    frames_written = frame->seq;
+    pthread_cond_broadcast(&writer_idle);
+    pthread_mutex_unlock(&writer_lock);
+  }
+
+  return NULL;
+}
+
+/* Returns a frame for the main thread to fill. If the writer hasn't picked up
+ * the last one yet, that one is taken back, keeping its queued bytes. */
+static struct frame *writer_acquire(void) {
+  int slot = __atomic_exchange_n(&frame_middle, frame_main, __ATOMIC_ACQ_REL);
+  struct frame *frame;
+
+  frame_main = FRAME_INDEX(slot);
+  frame = &frames[frame_main];
+
+  if (slot & FRAME_FRESH)
+    frames_dropped++;
+  else
+    bytebuffer_clear(&frame->prefix);
+
+  return frame;
+}
+
+static void writer_publish(struct frame *frame) {
+  pthread_mutex_lock(&writer_lock);
+  frame->seq = ++frames_published;
+  pthread_mutex_unlock(&writer_lock);
+
+  frame_main = FRAME_INDEX(__atomic_exchange_n(&frame_middle, frame_main | FRAME_FRESH, __ATOMIC_ACQ_REL));
+  sem_post(&writer_wakeup);
+}
+
+// waits until the writer has written the last frame handed to it
+static void writer_drain(void) {
+  if (!writer_running)
+    return;
+
+  pthread_mutex_lock(&writer_lock);
+  while (frames_written != frames_published)
+    pthread_cond_wait(&writer_idle, &writer_lock);
+  pthread_mutex_unlock(&writer_lock);
+}
+
+static int writer_start(void) {
+  int i;
+
+  if (writer_running)
+    return 0;
+
+  for (i = 0; i < 3; ++i) {
+    memset(&frames[i].buf, 0, sizeof(struct cellbuf));
+    bytebuffer_init(&frames[i].prefix, 0);
+  }
+
+  bytebuffer_init(&writer_output, OUTPUT_BASELINE);
+
+  frame_main = 0;
+  frame_middle = 1;
+  frame_writer = 2;
+  frames_published = frames_written = 0;
+  writer_queued = writer_counted = 0;
+  writer_stop = false;
+
+  if (sem_init(&writer_wakeup, 0, 0) != 0)
+    goto fail;
+
+  if (pthread_create(&writer_thread, NULL, writer_main, NULL) != 0) {
+    sem_destroy(&writer_wakeup);
+    goto fail;
+  }
+
+  writer_running = true;
+  return 0;
+
+fail:
+  for (i = 0; i < 3; ++i)
+    bytebuffer_free(&frames[i].prefix);
+  bytebuffer_free(&writer_output);
+  return -1;
+}
+
+static void writer_shutdown(void) {
+  int i;
+
+  if (!writer_running)
+    return;
+
+  writer_drain();
+  __atomic_store_n(&writer_stop, true, __ATOMIC_RELEASE);
+  sem_post(&writer_wakeup);
+  pthread_join(writer_thread, NULL);
+  sem_destroy(&writer_wakeup);
+  writer_running = false;
+
+  for (i = 0; i < 3; ++i) {
+    cellbuf_free(&frames[i].buf);
+    bytebuffer_free(&frames[i].prefix);
+  }
+  bytebuffer_free(&writer_output);
+}
@@ -0,0 +1,192 @@
+// Golden output: renders frames headless (tb_init_headless) and checks the
+// exact bytes tb_render() hands to the sink. Covers the SGR deltas, the cursor
+// moves picked, REP/ECH/EL runs, layers and grapheme clusters. TERM is unset,
+// so the sequences are always xterm's built-in ones.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../src/termbox.h"
+
+#ifdef WITH_TRUECOLOR
+#define OUTPUT_MODE TB_OUTPUT_TRUECOLOR
+#define RED "38;2;255;0;0"
+#define GREEN "38;2;0;255;0"
+#define YELLOW "38;2;255;255;0"
+#define WHITE "38;2;255;255;255"
+#define ON_BLUE "48;2;0;0;255"
+#define ON_RED "48;2;255;0;0"
+// TB_DEFAULT has the bit of TB_BOLD here
+#define CLEAR_SGR "\033[1m"
+#define RESET "\033(B\033[m"
+#define TO_DEFAULT "0;1"
+#else
+#define OUTPUT_MODE TB_OUTPUT_NORMAL
+#define RED "31"
+#define GREEN "32"
+#define YELLOW "33"
+#define WHITE "1;37" // bright, with TB_OUTPUT_NORMAL
+#define ON_BLUE "44"
+#define ON_RED "41"
+#define CLEAR_SGR ""
+#define RESET ""
+#define TO_DEFAULT "0"
+#endif
+
+static char output[64 * 1024];
+static int output_len = 0;
+static int failed = 0;
+
+static void sink(const char *data, int len, void *user_data) {
+  (void)user_data;
+  if (output_len + len > (int)sizeof(output))
+    len = sizeof(output) - output_len;
+  memcpy(output + output_len, data, len);
+  output_len += len;
+}
+
+static void print_escaped(const char *s, int len) {
+  int i;
+
+  for (i = 0; i < len; ++i) {
+    unsigned char c = s[i];
+    if (c == '\033')
+      fputs("\\033", stderr);
+    else if (c == '\r')
+      fputs("\\r", stderr);
+    else if (c == '\n')
+      fputs("\\n", stderr);
+    else if (c < 0x20 || c >= 0x7F)
+      fprintf(stderr, "\\x%02x", c);
+    else
+      fputc(c, stderr);
+  }
+  fputc('\n', stderr);
+}
+
+// checks what was sent since the last call against 'want'
+static void expect(const char *what, const char *want) {
+  int len = strlen(want);
+
+  if (output_len != len || memcmp(output, want, len) != 0) {
+    fprintf(stderr, "%s: got\n  ", what);
+    print_escaped(output, output_len);
+    fprintf(stderr, "wanted\n  ");
+    print_escaped(want, len);
+    failed = 1;
+  }
+  output_len = 0;
+}
+
+static void screen(void) {
+  int x, l;
+
+  if (tb_init_headless(20, 4, TB_INIT_ALL, sink, NULL) != 0) {
+    fprintf(stderr, "tb_init_headless failed\n");
+    exit(1);
+  }
+  expect("init", "\033[?25l\033[?1h\033=\033[?1049h\033(B\033[m" CLEAR_SGR "\033[H\033[2J");
+  tb_select_output_mode(OUTPUT_MODE);
+
+  tb_render();
+  expect("empty frame", "");
+
+  // only what changes from one cell to the next, or a reset when shorter
+  tb_char(0, 0, TB_RED, TB_DEFAULT, 'a');
+  tb_char(1, 0, TB_RED | TB_BOLD, TB_DEFAULT, 'b');
+  tb_char(2, 0, TB_GREEN, TB_DEFAULT, 'c');
+  tb_char(3, 0, TB_GREEN, TB_BLUE, 'd');
+  tb_char(4, 0, TB_GREEN | TB_UNDERLINE, TB_BLUE, 'e');
+  tb_char(5, 0, TB_DEFAULT, TB_DEFAULT, 'f');
+  tb_render();
+  expect("sgr", RESET "\033[" RED "m\033[1;1Ha\033[1mb\033[0;" GREEN "mc\033[" ON_BLUE "md\033[4me\033["
+    TO_DEFAULT "mf");
+
+  // the cursor's position is forgotten between frames, then CUF, a blank sent
+  // again, CUD + CR
+  tb_char(0, 1, TB_DEFAULT, TB_DEFAULT, 'x');
+  tb_char(9, 1, TB_DEFAULT, TB_DEFAULT, 'y');
+  tb_char(11, 1, TB_DEFAULT, TB_DEFAULT, 'z');
+  tb_char(0, 3, TB_DEFAULT, TB_DEFAULT, 'w');
+  tb_char(2, 3, TB_DEFAULT, TB_DEFAULT, 'v');
+  tb_render();
+  expect("moves", "\033[2;1Hx\033[8Cy z\033[2B\rw v");
+
+  // REP for a run of one char, ECH for blanks in a color, LF + CR for the next
+  // row down
+  tb_clear_buffer();
+  for (x = 0; x < 20; ++x) {
+    tb_char(x, 0, TB_DEFAULT, TB_DEFAULT, '-');
+    tb_char(x, 1, TB_DEFAULT, x >= 3 && x < 12 ? TB_BLUE : TB_DEFAULT, x < 2 ? '#' : ' ');
+  }
+  tb_string(0, 2, TB_DEFAULT, TB_DEFAULT, "ab");
+  tb_render();
+  expect("runs", "\033[1;1H-\033[19b\033[2;1H##\033[" ON_BLUE "m\033[C\033[9X\033[49m\n\rab\n\r   ");
+
+  tb_shutdown();
+  output_len = 0;
+
+  if (tb_init_headless(12, 3, TB_INIT_ALL, sink, NULL) != 0) {
+    fprintf(stderr, "tb_init_headless failed\n");
+    exit(1);
+  }
+  tb_select_output_mode(OUTPUT_MODE);
+  tb_render();
+  output_len = 0;
+
+  // an opaque layer hides what's under it (its blanks too), a transparent
+  // one only where something is drawn on it
+  tb_string(0, 0, TB_DEFAULT, TB_DEFAULT, "abcdefghijkl");
+  l = tb_layer_create(2, 0, 4, 2, 1, TB_LAYER_OPAQUE);
+  tb_select_layer(l);
+  tb_string(0, 0, TB_WHITE, TB_RED, "LY");
+  x = tb_layer_create(8, 0, 3, 1, 2, 0);
+  tb_select_layer(x);
+  tb_char(1, 0, TB_YELLOW, TB_DEFAULT, '*');
+  tb_select_layer(0);
+  tb_render();
+#ifdef WITH_TRUECOLOR
+  expect("layers", RESET "\033[1m\033[1;1Hab\033[0;" WHITE ";" ON_RED "mLY\033[1;39;49m  ghi\033[0;"
+    YELLOW "m*\033[1;39mkl");
+#else
+  expect("layers", "\033[1;1Hab\033[" WHITE ";" ON_RED "mLY\033[0m  ghi\033[" YELLOW "m*\033[39mkl");
+#endif
+
+  // moving it shows what it covered, and only its drawn cells are sent
+  tb_layer_move(l, 6, 1);
+  tb_render();
+#ifdef WITH_TRUECOLOR
+  expect("layer moved", "\033[1;3Hcdef\033[0;" WHITE ";" ON_RED "m\033[BLY");
+#else
+  expect("layer moved", "\033[1;3Hcdef\033[" WHITE ";" ON_RED "m\033[BLY");
+#endif
+
+  // clusters go out whole: a combining mark, a flag and a ZWJ sequence
+  tb_layer_destroy(l);
+  tb_layer_destroy(x);
+  tb_clear_buffer();
+  tb_string(0, 2, TB_DEFAULT, TB_DEFAULT,
+    "e\xcc\x81|\xf0\x9f\x87\xab\xf0\x9f\x87\xb7|\xf0\x9f\x91\xa9\xe2\x80\x8d\xf0\x9f\x92\xbb.");
+  tb_render();
+#ifdef WITH_TRUECOLOR
+  expect("clusters", "\033[1;39;49m\033[1;1H\033[K\033[2;7H  \n\r"
+#else
+  expect("clusters", "\033[0m\033[1;1H\033[K\033[2;7H  \n\r"
+#endif
+    "e\xcc\x81|\xf0\x9f\x87\xab\xf0\x9f\x87\xb7|\xf0\x9f\x91\xa9\xe2\x80\x8d\xf0\x9f\x92\xbb.");
+
+  // the flag and the emoji take two columns each
+  if (tb_cell_buffer()[2 * 12 + 7].ch != '.') {
+    fprintf(stderr, "clusters: '.' isn't at column 7\n");
+    failed = 1;
+  }
+
+  tb_shutdown();
+}
+
+int main(void) {
+  unsetenv("TERM");
+  screen();
+  return failed;
+}
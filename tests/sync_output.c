@@ -0,0 +1,160 @@
+// Checks synchronized output on a pty: with TB_INIT_SYNC_OUTPUT every frame
+// tb_render() writes is wrapped in CSI ? 2026 h / CSI ? 2026 l, and goes out
+// in as few writes as its size allows. Without the flag (TB_INIT_ALL, as
+// tb_init() uses) nothing is wrapped.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pty.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include "../src/termbox.h"
+
+#define WIDTH 200
+#define HEIGHT 60
+#define FRAMES 10
+
+// the largest write termbox makes at a time, see FLUSH_CHUNK
+#define WRITE_CHUNK (64 * 1024)
+
+#define BEGIN "\033[?2026h"
+#define END "\033[?2026l"
+
+static long writes = 0;
+static long written = 0;
+
+// counts what termbox writes out, all of which goes through writev()
+ssize_t writev(int fd, const struct iovec *iov, int cnt) {
+  ssize_t n = syscall(SYS_writev, fd, iov, cnt);
+  writes++;
+  if (n > 0)
+    written += n;
+  return n;
+}
+
+// draws frames on the pty, failing if one takes more writes than it should
+static int child(int fd, int flags) {
+  long w, b;
+  int f, x, y;
+
+  if (tb_init_fd(fd) != 0 || tb_init_screen(flags) != 0)
+    return 2;
+  tb_select_output_mode(TB_OUTPUT_256);
+
+  for (f = 0; f < FRAMES; ++f) {
+    for (y = 0; y < HEIGHT; ++y) {
+      for (x = 0; x < WIDTH; ++x)
+        tb_char(x, y, (x + y + f) % 256, (x * y + f) % 256, 'a' + (x + f) % 26);
+    }
+    // on a row of its own each frame, so all of it is sent
+    tb_stringf(0, f, TB_DEFAULT, TB_DEFAULT, "<frame %d>", f);
+
+    w = writes;
+    b = written;
+    tb_render();
+    w = writes - w;
+    b = written - b;
+
+    if (w > (b + WRITE_CHUNK - 1) / WRITE_CHUNK) {
+      fprintf(stderr, "frame %d: %ld bytes in %ld writes\n", f, b, w);
+      return 1;
+    }
+  }
+
+  tb_shutdown();
+  return 0;
+}
+
+// runs child() on a new pty, returning everything it wrote, or NULL
+static char *run(int flags, int *len) {
+  struct winsize ws = { HEIGHT, WIDTH, 0, 0 };
+  int master, slave, status, n, cap = 1 << 20;
+  char *out = malloc(cap);
+  pid_t pid;
+
+  if (openpty(&master, &slave, NULL, NULL, &ws) < 0)
+    return NULL;
+
+  pid = fork();
+  if (pid == 0) {
+    close(master);
+    setenv("TERM", "xterm", 1);
+    _exit(child(slave, flags));
+  }
+  close(slave);
+
+  *len = 0;
+  while (1) {
+    if (*len == cap)
+      out = realloc(out, cap *= 2);
+    n = read(master, out + *len, cap - *len);
+    if (n > 0)
+      *len += n;
+    else if (n < 0 && errno == EINTR)
+      continue;
+    else
+      break; // EIO once the child is gone
+  }
+  close(master);
+
+  waitpid(pid, &status, 0);
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "child failed (flags %d)\n", flags);
+    free(out);
+    return NULL;
+  }
+  return out;
+}
+
+static char *find(char *s, char *end, const char *what) {
+  return memmem(s, end - s, what, strlen(what));
+}
+
+int main(void) {
+  char *out, *end, *p, *begin, *stop, marker[32];
+  int len, f;
+
+  out = run(TB_INIT_ALL, &len);
+  if (!out)
+    return 1;
+  if (find(out, out + len, BEGIN) || find(out, out + len, END)) {
+    fprintf(stderr, "TB_INIT_ALL wraps frames\n");
+    return 1;
+  }
+  free(out);
+
+  out = run(TB_INIT_ALL | TB_INIT_SYNC_OUTPUT, &len);
+  if (!out)
+    return 1;
+  end = out + len;
+
+  // each frame is one begin/end pair, with nothing else of it outside
+  for (p = out, f = 0; f < FRAMES; ++f) {
+    begin = find(p, end, BEGIN);
+    stop = begin ? find(begin, end, END) : NULL;
+    if (!stop || find(begin + 1, stop, BEGIN)) {
+      fprintf(stderr, "frame %d isn't wrapped\n", f);
+      return 1;
+    }
+
+    sprintf(marker, "<frame %d>", f);
+    if (!find(begin, stop, marker)) {
+      fprintf(stderr, "frame %d is outside its wrapping\n", f);
+      return 1;
+    }
+    p = stop + strlen(END);
+  }
+
+  if (find(p, end, BEGIN) || find(p, end, END)) {
+    fprintf(stderr, "more wrapping than frames\n");
+    return 1;
+  }
+
+  free(out);
+  return 0;
+}
@@ -0,0 +1,85 @@
+#!/usr/bin/env python3
+
+# Generates src/unicode_width.inl, the two-stage table behind
+# tb_unicode_char_width(). Uses the Unicode database that ships with Python,
+# so run it with the newest Python around to pick up a recent version:
+#
+#   python3 tools/gen_unicode_width.py > src/unicode_width.inl
+
+import sys, unicodedata
+
+MAX_CODEPOINT = 0x110000
+BLOCK = 256 # codepoints per second stage block
+
+PREPENDED_MARKS = set(list(range(0x600, 0x606)) + [0x6DD, 0x70F, 0x890, 0x891, 0x8E2, 0x110BD, 0x110CD])
+
+def w(s):
+	sys.stdout.write(s)
+
+def char_width(cp):
+	# controls take no column on their own (wcwidth() says -1)
+	if cp < 0x20 or 0x7F <= cp < 0xA0:
+		return 0
+
+	# soft hyphen and the prepended concatenation marks are format chars,
+	# but terminals do show them
+	if cp == 0xAD or cp in PREPENDED_MARKS:
+		return 1
+
+	# medial vowels and final consonants of conjoining Hangul
+	if 0x1160 <= cp <= 0x11FF or 0xD7B0 <= cp <= 0xD7FF:
+		return 0
+
+	c = chr(cp)
+	if unicodedata.category(c) in ('Mn', 'Me', 'Cf'):
+		return 0
+
+	if unicodedata.east_asian_width(c) in ('W', 'F'):
+		return 2
+
+	# unassigned codepoints in the CJK planes default to wide
+	if 0x20000 <= cp <= 0x3FFFD:
+		return 2
+
+	return 1
+
+def main():
+	blocks = []
+	index = {}
+	stage1 = []
+
+	for start in range(0, MAX_CODEPOINT, BLOCK):
+		packed = [0] * (BLOCK // 4)
+		for i in range(BLOCK):
+			packed[i // 4] |= char_width(start + i) << ((i % 4) * 2)
+
+		key = tuple(packed)
+		if key not in index:
+			index[key] = len(blocks)
+			blocks.append(packed)
+		stage1.append(index[key])
+
+	if len(blocks) > 256:
+		sys.exit("too many distinct blocks for 8-bit indexes: %d" % len(blocks))
+
+	w("// Generated by tools/gen_unicode_width.py from Unicode %s. Do not edit.\n" % unicodedata.unidata_version)
+	w("//\n")
+	w("// Column width of every codepoint (0, 1 or 2), 2 bits each. The first stage\n")
+	w("// maps cp >> 8 to a block of the second stage, which holds 256 widths.\n\n")
+
+	w("#define UNICODE_WIDTH_VERSION \"%s\"\n\n" % unicodedata.unidata_version)
+
+	w("static const uint8_t width_stage1[%d] = {\n" % len(stage1))
+	for i in range(0, len(stage1), 16):
+		w("  " + " ".join("%d," % n for n in stage1[i:i+16]) + "\n")
+	w("};\n\n")
+
+	w("static const uint8_t width_stage2[%d][%d] = {\n" % (len(blocks), BLOCK // 4))
+	for packed in blocks:
+		w("  {\n")
+		for i in range(0, len(packed), 16):
+			w("    " + " ".join("0x%02x," % n for n in packed[i:i+16]) + "\n")
+		w("  },\n")
+	w("};\n")
+
+main()